@@ -1153,6 +1153,29 @@ SRST
   Enables or disables migration mode.
 ERST
 
+#if defined(TARGET_AARCH64)
+    {
+        .name       = "smc_load_keys",
+        .args_type  = "filename:F",
+        .params     = "filename",
+        .help       = "load Apple SMC key definitions from 'filename'",
+        .cmd        = hmp_smc_load_keys,
+    },
+#endif
+
+SRST
+``smc_load_keys`` *filename*
+  Load Apple SMC key definitions from a key file. Each group is a
+  FourCC key name and holds ``type``, ``size``, an optional ``attr``
+  and an optional hex ``data`` string, for example::
+
+    [TG0B]
+    type=ioft
+    size=8
+    data=0000000000000000
+
+ERST
+
     {
         .name       = "snapshot_blkdev",
         .args_type  = "reuse:-n,device:B,snapshot-file:s?,format:s?",
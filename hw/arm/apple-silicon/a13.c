@@ -28,6 +28,7 @@
 #include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
 #include "qemu/queue.h"
@@ -107,7 +108,6 @@ static QTAILQ_HEAD(, AppleA13Cluster) clusters =
     QTAILQ_HEAD_INITIALIZER(clusters);
 
 static uint64_t ipi_cr = kDeferredIPITimerDefault;
-static QEMUTimer *ipicr_timer = NULL;
 
 inline bool apple_a13_cpu_is_sleep(AppleA13State *tcpu)
 {
@@ -183,14 +183,56 @@ static void apple_a13_cluster_cpreg_write(CPUARMState *env,
 }
 
 /* Deliver IPI */
-static void apple_a13_cluster_deliver_ipi(AppleA13Cluster *c, uint64_t cpu_id,
+static bool apple_a13_cluster_deliver_ipi(AppleA13Cluster *c, uint64_t cpu_id,
                                           uint64_t src_cpu, uint64_t flag)
 {
     if (c->cpus[cpu_id]->ipi_sr)
-        return;
+        return false;
 
     c->cpus[cpu_id]->ipi_sr = 1LL | (src_cpu << IPI_SR_SRC_CPU_SHIFT) | flag;
     qemu_irq_raise(c->cpus[cpu_id]->fast_ipi);
+    return true;
+}
+
+/* Arm the cluster IPI timer for the earliest outstanding deadline */
+static void apple_a13_cluster_update_ipi_timer(AppleA13Cluster *c)
+{
+    int64_t next = INT64_MAX;
+    int i, j;
+
+    for (i = 0; i < A13_MAX_CPU; i++) { /* source */
+        for (j = 0; j < A13_MAX_CPU; j++) { /* target */
+            if (c->ipi_deadline[i][j] && c->ipi_deadline[i][j] < next) {
+                next = c->ipi_deadline[i][j];
+            }
+        }
+    }
+
+    if (next == INT64_MAX) {
+        timer_del(c->ipi_timer);
+    } else {
+        timer_mod_ns(c->ipi_timer, next);
+    }
+}
+
+/* Queue a deferred or no-wake IPI to fire after the programmed countdown */
+static void apple_a13_cluster_queue_ipi(AppleA13Cluster *c, uint32_t src_cpu,
+                                        uint32_t cpu_id)
+{
+    c->ipi_deadline[src_cpu][cpu_id] =
+        qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ipi_cr;
+    apple_a13_cluster_update_ipi_timer(c);
+}
+
+static void apple_a13_cluster_retract_ipi(AppleA13Cluster *c, uint32_t src_cpu,
+                                          uint32_t cpu_id)
+{
+    c->deferredIPI[src_cpu][cpu_id] = 0;
+    c->noWakeIPI[src_cpu][cpu_id] = 0;
+    if (c->ipi_deadline[src_cpu][cpu_id]) {
+        c->ipi_deadline[src_cpu][cpu_id] = 0;
+        apple_a13_cluster_update_ipi_timer(c);
+    }
 }
 
 static int apple_a13_cluster_pre_save(void *opaque)
@@ -203,7 +245,21 @@ static int apple_a13_cluster_pre_save(void *opaque)
 static int apple_a13_cluster_post_load(void *opaque, int version_id)
 {
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(opaque);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int i, j;
+
     ipi_cr = cluster->ipi_cr;
+
+    /* Deadlines are not migrated, restart the countdown of pending IPIs */
+    for (i = 0; i < A13_MAX_CPU; i++) {
+        for (j = 0; j < A13_MAX_CPU; j++) {
+            cluster->ipi_deadline[i][j] =
+                (cluster->deferredIPI[i][j] || cluster->noWakeIPI[i][j]) ?
+                    now + ipi_cr :
+                    0;
+        }
+    }
+    apple_a13_cluster_update_ipi_timer(cluster);
     return 0;
 }
 
@@ -212,6 +268,10 @@ static void apple_a13_cluster_reset(DeviceState *dev)
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(dev);
     memset(cluster->deferredIPI, 0, sizeof(cluster->deferredIPI));
     memset(cluster->noWakeIPI, 0, sizeof(cluster->noWakeIPI));
+    memset(cluster->ipi_deadline, 0, sizeof(cluster->ipi_deadline));
+    if (cluster->ipi_timer) {
+        timer_del(cluster->ipi_timer);
+    }
 }
 
 static int add_cpu_to_cluster(Object *obj, void *opaque)
@@ -234,11 +294,16 @@ static int add_cpu_to_cluster(Object *obj, void *opaque)
     return 0;
 }
 
+static void apple_a13_cluster_ipi_tick(void *opaque);
+
 static void apple_a13_cluster_realize(DeviceState *dev, Error **errp)
 {
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(dev);
     object_child_foreach_recursive(OBJECT(cluster), add_cpu_to_cluster, dev);
 
+    cluster->ipi_timer =
+        timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_a13_cluster_ipi_tick, cluster);
+
     if (cluster->size) {
         memory_region_init_ram_device_ptr(
             &cluster->mr, OBJECT(cluster),
@@ -247,63 +312,53 @@ static void apple_a13_cluster_realize(DeviceState *dev, Error **errp)
     }
 }
 
-static void apple_a13_cluster_tick(AppleA13Cluster *c)
+/*
+ * Fire every deferred or no-wake IPI whose countdown has expired.
+ * IPIs that cannot be taken yet (target busy, asleep or off) are retried
+ * after another countdown, and deadlines with nothing left pending are
+ * dropped.
+ */
+static void apple_a13_cluster_ipi_tick(void *opaque)
 {
+    AppleA13Cluster *c = APPLE_A13_CLUSTER(opaque);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    bool delivered;
     int i, j;
 
     for (i = 0; i < A13_MAX_CPU; i++) { /* source */
         for (j = 0; j < A13_MAX_CPU; j++) { /* target */
-            if (c->cpus[j] && c->deferredIPI[i][j] &&
-                !apple_a13_cpu_is_powered_off(c->cpus[j])) {
-                apple_a13_cluster_deliver_ipi(c, j, i, IPI_RR_TYPE_DEFERRED);
-                break;
+            if (!c->ipi_deadline[i][j] || c->ipi_deadline[i][j] > now) {
+                continue;
             }
-        }
-    }
 
-    for (i = 0; i < A13_MAX_CPU; i++) { /* source */
-        for (j = 0; j < A13_MAX_CPU; j++) { /* target */
-            if (c->cpus[j] && c->noWakeIPI[i][j] &&
-                !apple_a13_cpu_is_sleep(c->cpus[j]) &&
-                !apple_a13_cpu_is_powered_off(c->cpus[j])) {
-                apple_a13_cluster_deliver_ipi(c, j, i, IPI_RR_TYPE_NOWAKE);
-                break;
+            if (!c->deferredIPI[i][j] && !c->noWakeIPI[i][j]) {
+                c->ipi_deadline[i][j] = 0;
+                continue;
             }
-        }
-    }
-}
-
-static void apple_a13_cluster_ipicr_tick(void *opaque)
-{
-    AppleA13Cluster *cluster;
-    QTAILQ_FOREACH (cluster, &clusters, next) {
-        apple_a13_cluster_tick(cluster);
-    }
-
-    timer_mod_ns(ipicr_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ipi_cr);
-}
 
+            delivered = false;
+            if (c->cpus[j] && !apple_a13_cpu_is_powered_off(c->cpus[j])) {
+                if (c->deferredIPI[i][j]) {
+                    delivered = apple_a13_cluster_deliver_ipi(
+                        c, j, i, IPI_RR_TYPE_DEFERRED);
+                } else if (c->noWakeIPI[i][j] &&
+                           !apple_a13_cpu_is_sleep(c->cpus[j])) {
+                    delivered = apple_a13_cluster_deliver_ipi(
+                        c, j, i, IPI_RR_TYPE_NOWAKE);
+                }
+            }
 
-static void apple_a13_cluster_reset_handler(void *opaque)
-{
-    if (ipicr_timer) {
-        timer_del(ipicr_timer);
-        ipicr_timer = NULL;
+            c->ipi_deadline[i][j] = delivered ? 0 : now + ipi_cr;
+        }
     }
-    ipicr_timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_a13_cluster_ipicr_tick, NULL);
-    timer_mod_ns(ipicr_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
-                                  kDeferredIPITimerDefault);
+
+    apple_a13_cluster_update_ipi_timer(c);
 }
 
 static void apple_a13_cluster_instance_init(Object *obj)
 {
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(obj);
     QTAILQ_INSERT_TAIL(&clusters, cluster, next);
-
-    if (ipicr_timer == NULL) {
-        qemu_register_reset(apple_a13_cluster_reset_handler, NULL);
-    }
 }
 
 /* Deliver local IPI */
@@ -338,6 +393,7 @@ static void apple_a13_ipi_rr_local(CPUARMState *env, const ARMCPRegInfo *ri,
     case IPI_RR_TYPE_NOWAKE:
         if (apple_a13_cpu_is_sleep(c->cpus[cpu_id])) {
             c->noWakeIPI[tcpu->cpu_id][cpu_id] = 1;
+            apple_a13_cluster_queue_ipi(c, tcpu->cpu_id, cpu_id);
         } else {
             apple_a13_cluster_deliver_ipi(c, cpu_id, tcpu->cpu_id,
                                           IPI_RR_TYPE_IMMEDIATE);
@@ -345,10 +401,10 @@ static void apple_a13_ipi_rr_local(CPUARMState *env, const ARMCPRegInfo *ri,
         break;
     case IPI_RR_TYPE_DEFERRED:
         c->deferredIPI[tcpu->cpu_id][cpu_id] = 1;
+        apple_a13_cluster_queue_ipi(c, tcpu->cpu_id, cpu_id);
         break;
     case IPI_RR_TYPE_RETRACT:
-        c->deferredIPI[tcpu->cpu_id][cpu_id] = 0;
-        c->noWakeIPI[tcpu->cpu_id][cpu_id] = 0;
+        apple_a13_cluster_retract_ipi(c, tcpu->cpu_id, cpu_id);
         break;
     case IPI_RR_TYPE_IMMEDIATE:
         apple_a13_cluster_deliver_ipi(c, cpu_id, tcpu->cpu_id,
@@ -398,6 +454,7 @@ static void apple_a13_ipi_rr_global(CPUARMState *env, const ARMCPRegInfo *ri,
     case IPI_RR_TYPE_NOWAKE:
         if (apple_a13_cpu_is_sleep(c->cpus[cpu_id])) {
             c->noWakeIPI[tcpu->cpu_id][cpu_id] = 1;
+            apple_a13_cluster_queue_ipi(c, tcpu->cpu_id, cpu_id);
         } else {
             apple_a13_cluster_deliver_ipi(c, cpu_id, tcpu->cpu_id,
                                           IPI_RR_TYPE_IMMEDIATE);
@@ -405,10 +462,10 @@ static void apple_a13_ipi_rr_global(CPUARMState *env, const ARMCPRegInfo *ri,
         break;
     case IPI_RR_TYPE_DEFERRED:
         c->deferredIPI[tcpu->cpu_id][cpu_id] = 1;
+        apple_a13_cluster_queue_ipi(c, tcpu->cpu_id, cpu_id);
         break;
     case IPI_RR_TYPE_RETRACT:
-        c->deferredIPI[tcpu->cpu_id][cpu_id] = 0;
-        c->noWakeIPI[tcpu->cpu_id][cpu_id] = 0;
+        apple_a13_cluster_retract_ipi(c, tcpu->cpu_id, cpu_id);
         break;
     case IPI_RR_TYPE_IMMEDIATE:
         apple_a13_cluster_deliver_ipi(c, cpu_id, tcpu->cpu_id,
@@ -450,6 +507,13 @@ static void apple_a13_ipi_write_sr(CPUARMState *env, const ARMCPRegInfo *ri,
     default:
         break;
     }
+
+    if (!c->noWakeIPI[src_cpu][tcpu->cpu_id] &&
+        !c->deferredIPI[src_cpu][tcpu->cpu_id] &&
+        c->ipi_deadline[src_cpu][tcpu->cpu_id]) {
+        c->ipi_deadline[src_cpu][tcpu->cpu_id] = 0;
+        apple_a13_cluster_update_ipi_timer(c);
+    }
 }
 
 /* Read deferred interrupt timeout (global) */
@@ -469,13 +533,10 @@ static void apple_a13_ipi_write_cr(CPUARMState *env, const ARMCPRegInfo *ri,
 
     absolutetime_to_nanoseconds(value, &nanosec);
 
-    uint64_t ct;
+    if (nanosec == 0)
+        nanosec = kDeferredIPITimerDefault;
 
-    if (value == 0)
-        value = kDeferredIPITimerDefault;
-
-    ct = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    timer_mod_ns(ipicr_timer, (ct / ipi_cr) * ipi_cr + nanosec);
+    /* Applies to IPIs queued from now on */
     ipi_cr = nanosec;
 }
 
@@ -622,6 +683,27 @@ static void apple_a13_reset(DeviceState *dev)
     tclass->parent_reset(dev);
 }
 
+/* Rate of GL transitions since the previous read of this property */
+static void apple_a13_get_gl_transition_rate(Object *obj, Visitor *v,
+                                             const char *name, void *opaque,
+                                             Error **errp)
+{
+    AppleA13State *tcpu = APPLE_A13(obj);
+    uint64_t count = ARM_CPU(obj)->env.gxf.gl_transitions;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t value = 0;
+
+    if (tcpu->gl_rate_ns && now > tcpu->gl_rate_ns &&
+        count >= tcpu->gl_rate_count) {
+        value = (double)(count - tcpu->gl_rate_count) * NANOSECONDS_PER_SECOND /
+                (now - tcpu->gl_rate_ns);
+    }
+    tcpu->gl_rate_count = count;
+    tcpu->gl_rate_ns = now;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void apple_a13_instance_init(Object *obj)
 {
     ARMCPU *cpu = ARM_CPU(obj);
@@ -630,6 +712,11 @@ static void apple_a13_instance_init(Object *obj)
                                    OBJ_PROP_FLAG_READWRITE);
     object_property_add_uint64_ptr(obj, "pauth-mhi", &cpu->m_key_hi,
                                    OBJ_PROP_FLAG_READWRITE);
+    object_property_add_uint64_ptr(obj, "gl-transitions",
+                                   &cpu->env.gxf.gl_transitions,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add(obj, "gl-transitions-per-sec", "uint64",
+                        apple_a13_get_gl_transition_rate, NULL, NULL, NULL);
 }
 
 AppleA13State *apple_a13_cpu_create(DTBNode *node, char *name, uint32_t cpu_id,
@@ -134,10 +134,37 @@ static void far_el1_write(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 }
 
+/*
+ * Return true if going from @old_perm to @new_perm takes away any access
+ * from EL0. Cached TLB entries only ever grant what the permissions
+ * allowed when they were filled, so an access that is now allowed but
+ * was not will just miss and refill; only revoked access needs a flush.
+ */
+static bool sprr_perm_el0_revokes(uint64_t old_perm, uint64_t new_perm)
+{
+    if (old_perm == new_perm) {
+        return false;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        int old_prot =
+            arm_sprr_attr_to_prot(SPRR_EXTRACT_IDX_ATTR(old_perm, i), false);
+        int new_prot =
+            arm_sprr_attr_to_prot(SPRR_EXTRACT_IDX_ATTR(new_perm, i), false);
+
+        if (old_prot & ~new_prot) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static void sprr_perm_el0_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                 uint64_t value)
 {
-    uint64_t perm = raw_read(env, ri);
+    uint64_t old_perm = raw_read(env, ri);
+    uint64_t perm = old_perm;
     uint32_t mask = env->sprr.mprr_el_br_el1[0][0];
     if (arm_current_el(env)) {
         raw_write(env, ri, value);
@@ -161,7 +188,9 @@ static void sprr_perm_el0_write(CPUARMState *env, const ARMCPRegInfo *ri,
 
     raw_write(env, ri, perm);
 
-    tlb_flush_by_mmuidx(env_cpu(env), ARMMMUIdxBit_E10_0);
+    if (sprr_perm_el0_revokes(old_perm, perm)) {
+        tlb_flush_by_mmuidx(env_cpu(env), ARMMMUIdxBit_E10_0);
+    }
 }
 
 static uint64_t gxf_cpreg_raw_read(CPUARMState *env, const ARMCPRegInfo *ri)
@@ -27,10 +27,13 @@
 #include "hw/arm/apple-silicon/boot.h"
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/arm/apple-silicon/mem.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/guest-random.h"
+#include "qemu/madvise.h"
+#include "qemu/units.h"
 #include "img4.h"
 #include "lzfse.h"
 #include "lzss.h"
@@ -227,15 +230,140 @@ static void macho_dtb_node_process(DTBNode *node, DTBNode *parent)
     g_assert_cmpuint(cnt, ==, 0);
 }
 
+#define PAYLOAD_CACHE_MAGIC "QEMUIM4P"
+#define PAYLOAD_CACHE_VERSION (1)
+#define PAYLOAD_CACHE_DATA_OFFSET (0x4000)
+
+typedef struct QEMU_PACKED {
+    char magic[8];
+    uint32_t version;
+    char payload_type[4];
+    uint64_t payload_size;
+    uint64_t monitor_size;
+} PayloadCacheHeader;
+
+static char *payload_cache_path(const char *cache_dir,
+                                const uint8_t *file_data, size_t fsize)
+{
+    g_autofree char *digest = NULL;
+    Error *err = NULL;
+
+    if (cache_dir == NULL) {
+        return NULL;
+    }
+
+    if (qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, (const char *)file_data,
+                            fsize, &digest, &err) < 0) {
+        error_report_err(err);
+        return NULL;
+    }
+
+    return g_strdup_printf("%s/%s.im4p", cache_dir, digest);
+}
+
+static GBytes *payload_cache_load(const char *path, char *payload_type,
+                                  uint8_t **secure_monitor)
+{
+    g_autoptr(GMappedFile) mapped = NULL;
+    g_autoptr(GBytes) contents_bytes = NULL;
+    const PayloadCacheHeader *hdr;
+    const uint8_t *contents;
+    size_t length;
+
+    mapped = g_mapped_file_new(path, TRUE, NULL);
+    if (mapped == NULL) {
+        return NULL;
+    }
+
+    contents = (const uint8_t *)g_mapped_file_get_contents(mapped);
+    length = g_mapped_file_get_length(mapped);
+    hdr = (const PayloadCacheHeader *)contents;
+    if (length < PAYLOAD_CACHE_DATA_OFFSET ||
+        memcmp(hdr->magic, PAYLOAD_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        le32_to_cpu(hdr->version) != PAYLOAD_CACHE_VERSION ||
+        le64_to_cpu(hdr->payload_size) + le64_to_cpu(hdr->monitor_size) !=
+            length - PAYLOAD_CACHE_DATA_OFFSET) {
+        warn_report("Ignoring invalid payload cache entry '%s'", path);
+        return NULL;
+    }
+
+    memcpy(payload_type, hdr->payload_type, sizeof(hdr->payload_type));
+    if (secure_monitor && hdr->monitor_size) {
+        *secure_monitor = g_memdup2(contents + PAYLOAD_CACHE_DATA_OFFSET +
+                                        le64_to_cpu(hdr->payload_size),
+                                    le64_to_cpu(hdr->monitor_size));
+    }
+
+    contents_bytes = g_mapped_file_get_bytes(mapped);
+    return g_bytes_new_from_bytes(contents_bytes, PAYLOAD_CACHE_DATA_OFFSET,
+                                  le64_to_cpu(hdr->payload_size));
+}
+
+static bool payload_cache_store(const char *cache_dir, const char *path,
+                                const char *payload_type, GBytes *payload,
+                                const uint8_t *monitor, size_t monitor_size)
+{
+    g_autofree char *tmp_path = g_strdup_printf("%s.XXXXXX", path);
+    PayloadCacheHeader hdr = { 0 };
+    const void *data;
+    size_t size;
+    int fd;
+
+    data = g_bytes_get_data(payload, &size);
+
+    memcpy(hdr.magic, PAYLOAD_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = cpu_to_le32(PAYLOAD_CACHE_VERSION);
+    memcpy(hdr.payload_type, payload_type, sizeof(hdr.payload_type));
+    hdr.payload_size = cpu_to_le64(size);
+    hdr.monitor_size = cpu_to_le64(monitor_size);
+
+    if (g_mkdir_with_parents(cache_dir, 0755) < 0) {
+        warn_report("Could not create payload cache directory '%s': %s",
+                    cache_dir, strerror(errno));
+        return false;
+    }
+
+    fd = g_mkstemp(tmp_path);
+    if (fd < 0) {
+        warn_report("Could not create payload cache entry '%s': %s", tmp_path,
+                    strerror(errno));
+        return false;
+    }
+
+    // Write to a temporary file first, so that concurrent boots never map a
+    // partially written entry.
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        pwrite(fd, data, size, PAYLOAD_CACHE_DATA_OFFSET) != (ssize_t)size ||
+        (monitor_size &&
+         pwrite(fd, monitor, monitor_size, PAYLOAD_CACHE_DATA_OFFSET + size) !=
+             (ssize_t)monitor_size) ||
+        rename(tmp_path, path) < 0) {
+        warn_report("Could not write payload cache entry '%s': %s", path,
+                    strerror(errno));
+        unlink(tmp_path);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
 /*
+ * \param cache_dir if not NULL, the directory decoded payloads are cached in
  * \param payload_type must be at least 4 bytes long
+ * \param backing_path if not NULL, set to a file that holds the payload
+ * verbatim at \p backing_offset, or NULL if there is none
  */
-static void extract_im4p_payload(const char *filename, char *payload_type,
-                                 uint8_t **data, uint32_t *length,
-                                 uint8_t **secure_monitor)
+static GBytes *extract_im4p_payload(const char *filename,
+                                    const char *cache_dir, char *payload_type,
+                                    uint8_t **secure_monitor,
+                                    char **backing_path,
+                                    uint64_t *backing_offset)
 {
-    uint8_t *file_data;
-    unsigned long fsize;
+    g_autoptr(GMappedFile) mapped = NULL;
+    g_autofree char *cache_path = NULL;
+    const uint8_t *file_data;
+    size_t fsize;
     char errorDescription[ASN1_MAX_ERROR_DESCRIPTION_SIZE];
     asn1_node img4_definitions = NULL;
     asn1_node img4;
@@ -244,11 +372,42 @@ static void extract_im4p_payload(const char *filename, char *payload_type,
     char description[128];
     int len;
     uint8_t *payload_data;
+    uint8_t *monitor_data = NULL;
+    size_t monitor_size = 0;
+    GBytes *payload;
+    int64_t start, hashed, parsed, decoded;
+
+    start = g_get_monotonic_time();
+
+    if (backing_path) {
+        *backing_path = NULL;
+        *backing_offset = 0;
+    }
 
-    if (!g_file_get_contents(filename, (gchar **)&file_data, &fsize, NULL)) {
+    mapped = g_mapped_file_new(filename, TRUE, NULL);
+    if (mapped == NULL) {
         error_report("Could not load data from file '%s'", filename);
         exit(EXIT_FAILURE);
     }
+    file_data = (const uint8_t *)g_mapped_file_get_contents(mapped);
+    fsize = g_mapped_file_get_length(mapped);
+
+    cache_path = payload_cache_path(cache_dir, file_data, fsize);
+    hashed = g_get_monotonic_time();
+    if (cache_path != NULL) {
+        payload = payload_cache_load(cache_path, payload_type, secure_monitor);
+        if (payload != NULL) {
+            if (backing_path) {
+                *backing_path = g_steal_pointer(&cache_path);
+                *backing_offset = PAYLOAD_CACHE_DATA_OFFSET;
+            }
+            info_report("Loaded '%s' from the payload cache in %" PRId64
+                        " us (hash: %" PRId64 " us)",
+                        filename, g_get_monotonic_time() - start,
+                        hashed - start);
+            return payload;
+        }
+    }
 
     if (asn1_array2tree(img4_definitions_array, &img4_definitions,
                         errorDescription) != ASN1_SUCCESS) {
@@ -267,12 +426,13 @@ static void extract_im4p_payload(const char *filename, char *payload_type,
         asn1_der_decoding(&img4, file_data, (uint32_t)fsize, errorDescription);
 
     if (ret != ASN1_SUCCESS) {
-        *data = file_data;
-        *length = (uint32_t)fsize;
         strncpy(payload_type, "raw", 4);
         asn1_delete_structure(&img4);
         asn1_delete_structure(&img4_definitions);
-        return;
+        if (backing_path) {
+            *backing_path = g_strdup(filename);
+        }
+        return g_mapped_file_get_bytes(mapped);
     }
 
     len = 4;
@@ -317,7 +477,6 @@ static void extract_im4p_payload(const char *filename, char *payload_type,
 
     payload_data = g_malloc0(len);
     ret = asn1_read_value(img4, "data", payload_data, &len);
-    g_free(file_data);
 
     if (ret != ASN1_SUCCESS) {
         error_report("Failed to read the im4p payload in file '%s': %d.",
@@ -327,6 +486,7 @@ static void extract_im4p_payload(const char *filename, char *payload_type,
 
     asn1_delete_structure(&img4);
     asn1_delete_structure(&img4_definitions);
+    parsed = g_get_monotonic_time();
 
     if (memcmp(payload_data, "bvx", 3) == 0) {
         size_t decode_buffer_size = len * 8;
@@ -344,12 +504,9 @@ static void extract_im4p_payload(const char *filename, char *payload_type,
             exit(EXIT_FAILURE);
         }
 
-        *data = decode_buffer;
-        *length = decoded_length;
-        return;
-    }
-
-    if (memcmp(payload_data, "complzss", 8) == 0) {
+        payload = g_bytes_new_take(
+            g_realloc(decode_buffer, decoded_length), decoded_length);
+    } else if (memcmp(payload_data, "complzss", 8) == 0) {
         LzssCompHeader *comp_hdr = (LzssCompHeader *)payload_data;
         size_t uncompressed_size = be32_to_cpu(comp_hdr->uncompressed_size);
         size_t compressed_size = be32_to_cpu(comp_hdr->compressed_size);
@@ -364,33 +521,51 @@ static void extract_im4p_payload(const char *filename, char *payload_type,
         }
 
         size_t monitor_off = compressed_size + sizeof(LzssCompHeader);
-        if (secure_monitor && monitor_off < len) {
-            size_t monitor_size = len - monitor_off;
-            info_report("Found AP Secure Monitor in payload with size 0x%zX!",
-                        monitor_size);
-            *secure_monitor = g_malloc0(monitor_size);
-            memcpy(*secure_monitor, payload_data + monitor_off, monitor_size);
+        if (monitor_off < len) {
+            monitor_size = len - monitor_off;
+            monitor_data = g_memdup2(payload_data + monitor_off, monitor_size);
+            if (secure_monitor) {
+                info_report(
+                    "Found AP Secure Monitor in payload with size 0x%zX!",
+                    monitor_size);
+                *secure_monitor = g_memdup2(monitor_data, monitor_size);
+            }
         }
 
         g_free(payload_data);
 
-        *data = decode_buffer;
-        *length = decoded_length;
-        return;
+        payload = g_bytes_new_take(decode_buffer, decoded_length);
+    } else {
+        payload = g_bytes_new_take(payload_data, len);
     }
-
-    *data = payload_data;
-    *length = len;
+    decoded = g_get_monotonic_time();
+
+    if (cache_path != NULL &&
+        payload_cache_store(cache_dir, cache_path, payload_type, payload,
+                            monitor_data, monitor_size) &&
+        backing_path) {
+        *backing_path = g_steal_pointer(&cache_path);
+        *backing_offset = PAYLOAD_CACHE_DATA_OFFSET;
+    }
+    g_free(monitor_data);
+
+    info_report("Decoded '%s' in %" PRId64 " us (hash: %" PRId64
+                " us, parse: %" PRId64 " us, decompress: %" PRId64
+                " us, cache: %" PRId64 " us)",
+                filename, g_get_monotonic_time() - start, hashed - start,
+                parsed - hashed, decoded - parsed,
+                g_get_monotonic_time() - decoded);
+    return payload;
 }
 
-DTBNode *load_dtb_from_file(char *filename)
+DTBNode *load_dtb_from_file(char *filename, const char *cache_dir)
 {
     DTBNode *root = NULL;
-    uint8_t *file_data = NULL;
-    uint32_t fsize;
+    g_autoptr(GBytes) payload = NULL;
     char payload_type[4];
 
-    extract_im4p_payload(filename, payload_type, &file_data, &fsize, NULL);
+    payload = extract_im4p_payload(filename, cache_dir, payload_type, NULL,
+                                   NULL, NULL);
 
     if (strncmp(payload_type, "dtre", 4) != 0 &&
         strncmp(payload_type, "raw", 4) != 0) {
@@ -400,8 +575,7 @@ DTBNode *load_dtb_from_file(char *filename)
         exit(EXIT_FAILURE);
     }
 
-    root = load_dtb(file_data);
-    g_free(file_data);
+    root = load_dtb((uint8_t *)g_bytes_get_data(payload, NULL));
     return root;
 }
 
@@ -556,18 +730,20 @@ void macho_load_dtb(DTBNode *root, AddressSpace *as, MemoryRegion *mem,
                       info->device_tree_size, buf);
 }
 
-uint8_t *load_trustcache_from_file(const char *filename, uint64_t *size)
+uint8_t *load_trustcache_from_file(const char *filename,
+                                   const char *cache_dir, uint64_t *size)
 {
     uint32_t *trustcache_data = NULL;
     uint64_t trustcache_size = 0;
-    g_autofree uint8_t *file_data = NULL;
-    unsigned long file_size = 0;
-    uint32_t length = 0;
+    g_autoptr(GBytes) payload = NULL;
+    const uint8_t *file_data;
+    size_t file_size = 0;
     char payload_type[4];
     uint32_t trustcache_version, trustcache_entry_count, expected_file_size;
     uint32_t trustcache_entry_size = 0;
 
-    extract_im4p_payload(filename, payload_type, &file_data, &length, NULL);
+    payload = extract_im4p_payload(filename, cache_dir, payload_type, NULL,
+                                   NULL, NULL);
 
     if (strncmp(payload_type, "trst", 4) != 0 &&
         strncmp(payload_type, "rtsc", 4) != 0 &&
@@ -578,7 +754,7 @@ uint8_t *load_trustcache_from_file(const char *filename, uint64_t *size)
         exit(EXIT_FAILURE);
     }
 
-    file_size = (unsigned long)length;
+    file_data = g_bytes_get_data(payload, &file_size);
 
     trustcache_size = align_16k_high(file_size + 8);
     trustcache_data = (uint32_t *)g_malloc(trustcache_size);
@@ -616,7 +792,7 @@ uint8_t *load_trustcache_from_file(const char *filename, uint64_t *size)
 
     if (file_size != expected_file_size) {
         error_report("The expected size %d of trust cache '%s' does not match "
-                     "the actual size %ld",
+                     "the actual size %zu",
                      expected_file_size, filename, file_size);
         exit(EXIT_FAILURE);
     }
@@ -631,15 +807,70 @@ void macho_load_trustcache(void *trustcache, uint64_t size, AddressSpace *as,
     allocate_and_copy(mem, as, "TrustCache", pa, size, trustcache);
 }
 
-void macho_load_ramdisk(const char *filename, AddressSpace *as,
-                        MemoryRegion *mem, hwaddr pa, uint64_t *size)
+static void macho_unmap_ramdisk(MemoryRegion **ramdisk_mr)
 {
-    uint8_t *file_data = NULL;
-    unsigned long file_size = 0;
-    uint32_t length = 0;
+    MemoryRegion *mr = *ramdisk_mr;
+
+    if (mr == NULL) {
+        return;
+    }
+
+    memory_region_del_subregion(mr->container, mr);
+    vmstate_unregister_ram(mr, NULL);
+    object_unparent(OBJECT(mr));
+    *ramdisk_mr = NULL;
+}
+
+static MemoryRegion *macho_map_ramdisk(const char *path, uint64_t offset,
+                                       uint64_t size, MemoryRegion *mem,
+                                       hwaddr pa)
+{
+    MemoryRegion *mr;
+    Error *err = NULL;
+
+    mr = g_new0(MemoryRegion, 1);
+    if (!memory_region_init_ram_from_file(mr, NULL, "RamDisk", size, 0,
+                                          RAM_READONLY_FD, path, offset,
+                                          &err)) {
+        warn_report_err(err);
+        g_free(mr);
+        return NULL;
+    }
+    OBJECT(mr)->free = g_free;
+    vmstate_register_ram(mr, NULL);
+    memory_region_add_subregion_overlap(mem, pa, mr, 1);
+    return mr;
+}
+
+// Throw away whatever the guest wrote into an existing mapping of the same
+// layout, so that a reset reuses the region instead of mapping and
+// registering it again. Only Linux guarantees MADV_DONTNEED drops the
+// private copies of a file mapping.
+static bool macho_revert_ramdisk(MemoryRegion *mr, hwaddr pa, uint64_t size)
+{
+#ifdef CONFIG_LINUX
+    if (mr->addr == pa && memory_region_size(mr) == size) {
+        return qemu_madvise(memory_region_get_ram_ptr(mr), size,
+                            QEMU_MADV_DONTNEED) == 0;
+    }
+#endif
+    return false;
+}
+
+void macho_load_ramdisk(const char *filename, const char *cache_dir,
+                        AddressSpace *as, MemoryRegion *mem, hwaddr pa,
+                        MemoryRegion **ramdisk_mr, uint64_t *size)
+{
+    g_autoptr(GBytes) payload = NULL;
+    g_autofree char *backing_path = NULL;
+    uint64_t backing_offset = 0;
+    const uint8_t *file_data;
+    size_t file_size = 0;
+    uint64_t mapped_size = 0;
     char payload_type[4];
 
-    extract_im4p_payload(filename, payload_type, &file_data, &length, NULL);
+    payload = extract_im4p_payload(filename, cache_dir, payload_type, NULL,
+                                   &backing_path, &backing_offset);
     if (strncmp(payload_type, "rdsk", 4) != 0 &&
         strncmp(payload_type, "raw", 4) != 0) {
         error_report("Couldn't parse ASN.1 data in file '%s' because it is not "
@@ -648,12 +879,40 @@ void macho_load_ramdisk(const char *filename, AddressSpace *as,
         exit(EXIT_FAILURE);
     }
 
-    file_size = length;
-    file_data = g_realloc(file_data, file_size);
+    file_data = g_bytes_get_data(payload, &file_size);
+
+    // Map the whole pages of the ramdisk as a private copy-on-write view of
+    // the file holding it, so that VMs using the same ramdisk share the host
+    // page cache. Only the tail, if any, gets copied.
+    if (backing_path != NULL) {
+        mapped_size = align_16k_low(file_size);
+    }
+
+    // The previous boot's mapping must not keep what the guest wrote.
+    if (*ramdisk_mr != NULL &&
+        (mapped_size == 0 ||
+         !macho_revert_ramdisk(*ramdisk_mr, pa, mapped_size))) {
+        macho_unmap_ramdisk(ramdisk_mr);
+    }
+
+    if (mapped_size && *ramdisk_mr == NULL) {
+        *ramdisk_mr = macho_map_ramdisk(backing_path, backing_offset,
+                                        mapped_size, mem, pa);
+        if (*ramdisk_mr != NULL) {
+            info_report("Mapped %" PRIu64 " MiB of ramdisk '%s' from '%s'",
+                        mapped_size / MiB, filename, backing_path);
+        }
+    }
+    if (*ramdisk_mr == NULL) {
+        mapped_size = 0;
+    }
 
-    allocate_and_copy(mem, as, "RamDisk", pa, file_size, file_data);
+    if (file_size > mapped_size) {
+        allocate_and_copy(mem, as, "RamDisk", pa + mapped_size,
+                          file_size - mapped_size,
+                          (void *)(file_data + mapped_size));
+    }
     *size = file_size;
-    g_free(file_data);
 }
 
 void macho_load_raw_file(const char *filename, AddressSpace *as,
@@ -810,16 +1069,17 @@ void macho_text_base(MachoHeader64 *mh, uint64_t *base)
     }
 }
 
-MachoHeader64 *macho_load_file(const char *filename,
+MachoHeader64 *macho_load_file(const char *filename, const char *cache_dir,
                                MachoHeader64 **secure_monitor)
 {
-    uint32_t len;
-    uint8_t *data = NULL;
+    g_autoptr(GBytes) payload = NULL;
+    size_t len;
+    uint8_t *data;
     char payload_type[4];
     MachoHeader64 *mh = NULL;
 
-    extract_im4p_payload(filename, payload_type, &data, &len,
-                         (uint8_t **)secure_monitor);
+    payload = extract_im4p_payload(filename, cache_dir, payload_type,
+                                   (uint8_t **)secure_monitor, NULL, NULL);
 
     if (strncmp(payload_type, "krnl", 4) != 0 &&
         strncmp(payload_type, "raw", 4) != 0) {
@@ -829,8 +1089,8 @@ MachoHeader64 *macho_load_file(const char *filename,
         exit(EXIT_FAILURE);
     }
 
+    data = (uint8_t *)g_bytes_get_data(payload, &len);
     mh = macho_parse(data, len);
-    g_free(data);
     return mh;
 }
 
@@ -1207,11 +1467,16 @@ hwaddr arm_load_macho(MachoHeader64 *mh, AddressSpace *as, MemoryRegion *mem,
                 "Loading %s to 0x%llx (filesize: 0x%llX vmsize: 0x%llX)",
                 region_name, load_to, segCmd->filesize, segCmd->vmsize);
 #endif
-            uint8_t *buf = g_malloc0(segCmd->vmsize);
-            memcpy(buf, load_from, segCmd->filesize);
-            allocate_and_copy(mem, as, region_name, load_to, segCmd->vmsize,
-                              buf);
-            g_free(buf);
+            // Copy straight from the slid image and only zero-fill the part
+            // of the segment that is not backed by the file.
+            uint64_t filesize = MIN(segCmd->filesize, segCmd->vmsize);
+            allocate_and_copy(mem, as, region_name, load_to, filesize,
+                              load_from);
+            if (segCmd->vmsize > filesize) {
+                address_space_set(as, load_to + filesize, 0,
+                                  segCmd->vmsize - filesize,
+                                  MEMTXATTRS_UNSPECIFIED);
+            }
 
             if (!is_fileset) {
                 if (strcmp(segCmd->segname, "__TEXT") == 0) {
@@ -6,9 +6,13 @@
 #include "migration/vmstate.h"
 #include "monitor/hmp-target.h"
 #include "monitor/monitor.h"
+#include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
 #include "qemu/bitops.h"
 #include "qemu/module.h"
+#include "qemu/range.h"
+#include "qemu/seqlock.h"
+#include "qemu/stats64.h"
 #include "sysemu/dma.h"
 
 // #define DEBUG_DART
@@ -84,9 +88,8 @@
 #define DART_TTE_TYPE_MASK (0x3)
 #define DART_TTE_ADDR_MASK (0xFFFFFFFFFFull)
 
-#define DART_IOTLB_SID_SHIFT (53)
-#define DART_IOTLB_SID(_x) (((_x) & 0xfull) << 53)
-#define DART_IOTLB_SID_EX(_x) (((_x) >> 53) & 0xf)
+#define DART_TLB_SETS (32)
+#define DART_TLB_WAYS (4)
 
 typedef enum {
     DART_UNKNOWN = 0,
@@ -103,18 +106,45 @@ static const char *dart_instance_name[] = {
 };
 
 typedef struct AppleDARTTLBEntry {
+    uint64_t iova;
     hwaddr block_addr;
     IOMMUAccessFlags perm;
+    bool valid;
 } AppleDARTTLBEntry;
 
+/*
+ * Per-SID set-associative IOTLB. Lookups are lock-free and only retry
+ * when they race with a fill or an invalidation; writers serialise on
+ * the instance mutex.
+ */
+typedef struct AppleDARTTLB {
+    QemuSeqLock seq;
+    AppleDARTTLBEntry entries[DART_TLB_SETS][DART_TLB_WAYS];
+    uint8_t victim[DART_TLB_SETS];
+} AppleDARTTLB;
+
 typedef struct AppleDARTInstance AppleDARTInstance;
 
 typedef struct AppleDARTIOMMUMemoryRegion {
     IOMMUMemoryRegion parent_obj;
     AppleDARTInstance *o;
     uint32_t sid;
+    IOMMUNotifierFlag notifier_flags;
+    /* Leaf entries last sent to MAP notifiers, NULL if out of sync */
+    GArray *map_snapshot;
 } AppleDARTIOMMUMemoryRegion;
 
+typedef struct AppleDARTMapEntry {
+    uint64_t iova;
+    uint64_t pte;
+} AppleDARTMapEntry;
+
+/* Snapshot entry standing for a SID that passes IOVAs through untranslated */
+#define DART_MAP_ENTRY_BYPASS (~0ULL)
+
+typedef void (*AppleDARTWalkFn)(AppleDARTInstance *o, uint32_t sid,
+                                uint64_t iova, uint64_t pte, void *opaque);
+
 struct AppleDARTInstance {
     MemoryRegion iomem;
     AppleDARTIOMMUMemoryRegion *iommus[DART_MAX_STREAMS];
@@ -147,8 +177,14 @@ struct AppleDARTInstance {
     };
 #pragma pack(pop)
 
-    GHashTable *tlb;
+    AppleDARTTLB tlb[DART_MAX_STREAMS];
+    /* IOVA ranges handed out to IOMMU notifiers since the last invalidate */
+    GList *mapped[DART_MAX_STREAMS];
     QemuMutex mutex;
+    Stat64 tlb_hits;
+    Stat64 tlb_misses;
+    Stat64 ptw_walks;
+    Stat64 ptw_faults;
 };
 
 struct AppleDARTState {
@@ -188,16 +224,110 @@ static GSList *apple_dart_get_device_list(void)
     return list;
 }
 
-static gboolean apple_dart_tlb_remove_by_sid_mask(gpointer key, gpointer value,
-                                                  gpointer user_data)
+static bool apple_dart_tlb_lookup(AppleDARTTLB *tlb, uint64_t iova,
+                                  AppleDARTTLBEntry *entry)
+{
+    AppleDARTTLBEntry *set = tlb->entries[iova % DART_TLB_SETS];
+    unsigned int start;
+    bool found;
+    int way;
+
+    do {
+        start = seqlock_read_begin(&tlb->seq);
+        found = false;
+        for (way = 0; way < DART_TLB_WAYS; way++) {
+            if (set[way].valid && set[way].iova == iova) {
+                *entry = set[way];
+                found = true;
+                break;
+            }
+        }
+    } while (seqlock_read_retry(&tlb->seq, start));
+
+    return found;
+}
+
+/* Must be called with the instance mutex held. */
+static void apple_dart_tlb_insert(AppleDARTTLB *tlb,
+                                  const AppleDARTTLBEntry *entry)
+{
+    uint64_t idx = entry->iova % DART_TLB_SETS;
+    AppleDARTTLBEntry *set = tlb->entries[idx];
+    int way;
+
+    for (way = 0; way < DART_TLB_WAYS; way++) {
+        if (!set[way].valid) {
+            break;
+        }
+    }
+    if (way == DART_TLB_WAYS) {
+        way = tlb->victim[idx];
+        tlb->victim[idx] = (way + 1) % DART_TLB_WAYS;
+    }
+
+    seqlock_write_begin(&tlb->seq);
+    set[way] = *entry;
+    set[way].valid = true;
+    seqlock_write_end(&tlb->seq);
+}
+
+/* Must be called with the instance mutex held. */
+static void apple_dart_tlb_flush(AppleDARTTLB *tlb)
+{
+    seqlock_write_begin(&tlb->seq);
+    memset(tlb->entries, 0, sizeof(tlb->entries));
+    seqlock_write_end(&tlb->seq);
+    memset(tlb->victim, 0, sizeof(tlb->victim));
+}
+
+/* Must be called with the instance mutex held. */
+static void apple_dart_track_range(AppleDARTInstance *o, uint32_t sid,
+                                   hwaddr iova, hwaddr addr_mask)
 {
-    hwaddr va = (hwaddr)key;
-    uint64_t sid_mask = *(uint64_t *)user_data;
+    Range *range;
 
-    if ((1ULL << DART_IOTLB_SID_EX(va)) & sid_mask) {
-        return true;
+    for (GList *l = o->mapped[sid]; l; l = l->next) {
+        range = l->data;
+        if (range_contains(range, iova) &&
+            range_contains(range, iova + addr_mask)) {
+            return;
+        }
+    }
+
+    range = g_new0(Range, 1);
+    range_set_bounds(range, iova, iova + addr_mask);
+    o->mapped[sid] = range_list_insert(o->mapped[sid], range);
+}
+
+static void apple_dart_notify_unmap(AppleDARTInstance *o, uint32_t sid,
+                                    GList *ranges)
+{
+    IOMMUMemoryRegion *iommu = IOMMU_MEMORY_REGION(o->iommus[sid]);
+    IOMMUTLBEvent event = {
+        .type = IOMMU_NOTIFIER_UNMAP,
+        .entry.target_as = &address_space_memory,
+        .entry.perm = IOMMU_NONE,
+    };
+
+    for (GList *l = ranges; l; l = l->next) {
+        Range *range = l->data;
+        uint64_t start = range_lob(range);
+        uint64_t end = range_upb(range);
+
+        /* Notifiers need naturally aligned, power of two sized entries */
+        while (true) {
+            uint64_t mask = dma_aligned_pow2_mask(start, end, 64);
+
+            event.entry.iova = start;
+            event.entry.addr_mask = mask;
+            memory_region_notify_iommu(iommu, 0, event);
+
+            if (end - start <= mask) {
+                break;
+            }
+            start += mask + 1;
+        }
     }
-    return false;
 }
 
 static void apple_dart_update_irq(AppleDARTState *s)
@@ -214,6 +344,191 @@ static void apple_dart_update_irq(AppleDARTState *s)
 #endif /* DEBUG_DART */
 }
 
+static void apple_dart_pt_walk_level(AppleDARTInstance *o, uint32_t sid,
+                                     int level, uint64_t iova, hwaddr pa,
+                                     AppleDARTWalkFn fn, void *opaque)
+{
+    AppleDARTState *s = o->s;
+    uint64_t n = (s->l_mask[level] >> s->l_shift[level]) + 1;
+    g_autofree uint64_t *entries = g_new(uint64_t, n);
+
+    if (dma_memory_read(&address_space_memory, pa, entries,
+                        n * sizeof(uint64_t),
+                        MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t pte = entries[i];
+        uint64_t next_iova = iova | (i << s->l_shift[level]);
+
+        if ((pte & DART_TTE_VALID) == 0) {
+            continue;
+        }
+        if (level == 2) {
+            fn(o, sid, next_iova, pte, opaque);
+        } else {
+            apple_dart_pt_walk_level(o, sid, level + 1, next_iova,
+                                     pte & s->page_mask & DART_TTE_ADDR_MASK,
+                                     fn, opaque);
+        }
+    }
+}
+
+/* Calls @fn for every valid leaf entry reachable from @sid's TTBRs. */
+static void apple_dart_pt_walk(AppleDARTInstance *o, uint32_t sid,
+                               AppleDARTWalkFn fn, void *opaque)
+{
+    AppleDARTState *s = o->s;
+    uint32_t hw_sid = o->remap[sid] & 0xf;
+
+    for (uint64_t idx = 0; idx < DART_MAX_TTBR; idx++) {
+        uint32_t ttbr = o->ttbr[hw_sid][idx];
+
+        if ((ttbr & DART_TTBR_VALID) == 0) {
+            continue;
+        }
+        apple_dart_pt_walk_level(
+            o, sid, 1, idx << s->l_shift[0],
+            (hwaddr)(ttbr & DART_TTBR_MASK) << DART_TTBR_SHIFT, fn, opaque);
+    }
+}
+
+static bool apple_dart_sid_translates(AppleDARTInstance *o, uint32_t sid)
+{
+    uint32_t hw_sid = o->remap[sid] & 0xf;
+
+    return !(o->s->bypass & (1 << hw_sid)) &&
+           (o->tcr[hw_sid] & DART_TCR_TXEN) &&
+           !(o->tcr[hw_sid] & DART_TCR_BYPASS_DART);
+}
+
+static IOMMUTLBEvent apple_dart_map_event(AppleDARTInstance *o, uint64_t iova,
+                                          uint64_t pte)
+{
+    AppleDARTState *s = o->s;
+    IOMMUTLBEvent event = {
+        .type = IOMMU_NOTIFIER_MAP,
+        .entry.target_as = &address_space_memory,
+        .entry.iova = iova << s->page_shift,
+        .entry.translated_addr = pte & s->page_mask & DART_TTE_ADDR_MASK,
+        .entry.addr_mask = s->page_bits,
+        .entry.perm = IOMMU_ACCESS_FLAG(!(pte & DART_TTE_NO_READ),
+                                        !(pte & DART_TTE_NO_WRITE)),
+    };
+
+    return event;
+}
+
+static void apple_dart_map_one(AppleDARTInstance *o, uint32_t sid,
+                               uint64_t iova, uint64_t pte, void *opaque)
+{
+    IOMMUNotifier *notifier = opaque;
+    IOMMUTLBEvent event = apple_dart_map_event(o, iova, pte);
+
+    WITH_QEMU_LOCK_GUARD(&o->mutex)
+    {
+        apple_dart_track_range(o, sid, event.entry.iova,
+                               event.entry.addr_mask);
+    }
+
+    if (notifier) {
+        memory_region_notify_iommu_one(notifier, &event);
+    } else {
+        memory_region_notify_iommu(IOMMU_MEMORY_REGION(o->iommus[sid]), 0,
+                                   event);
+    }
+}
+
+static void apple_dart_map_bypass(AppleDARTInstance *o, uint32_t sid,
+                                  IOMMUNotifier *notifier)
+{
+    IOMMUTLBEvent event = {
+        .type = IOMMU_NOTIFIER_MAP,
+        .entry.target_as = &address_space_memory,
+        .entry.iova = 0,
+        .entry.translated_addr = o->s->bypass_address,
+        .entry.addr_mask = (1ULL << DART_MAX_VA_BITS) - 1,
+        .entry.perm = IOMMU_RW,
+    };
+
+    WITH_QEMU_LOCK_GUARD(&o->mutex)
+    {
+        apple_dart_track_range(o, sid, event.entry.iova,
+                               event.entry.addr_mask);
+    }
+
+    if (notifier) {
+        memory_region_notify_iommu_one(notifier, &event);
+    } else {
+        memory_region_notify_iommu(IOMMU_MEMORY_REGION(o->iommus[sid]), 0,
+                                   event);
+    }
+}
+
+/*
+ * Sends a MAP event for every live translation of @sid, either to a single
+ * @notifier or to all registered notifiers when @notifier is NULL.
+ */
+static void apple_dart_notify_map_one(AppleDARTInstance *o, uint32_t sid,
+                                      IOMMUNotifier *notifier)
+{
+    if (!apple_dart_sid_translates(o, sid)) {
+        apple_dart_map_bypass(o, sid, notifier);
+        return;
+    }
+
+    apple_dart_pt_walk(o, sid, apple_dart_map_one, notifier);
+}
+
+static void apple_dart_collect_one(AppleDARTInstance *o, uint32_t sid,
+                                   uint64_t iova, uint64_t pte, void *opaque)
+{
+    GArray *entries = opaque;
+    AppleDARTMapEntry entry = { .iova = iova, .pte = pte };
+
+    g_array_append_val(entries, entry);
+}
+
+/* Returns the leaf entries MAP notifiers of @sid should currently see. */
+static GArray *apple_dart_map_snapshot(AppleDARTInstance *o, uint32_t sid)
+{
+    GArray *entries = g_array_new(false, false, sizeof(AppleDARTMapEntry));
+
+    if (!apple_dart_sid_translates(o, sid)) {
+        AppleDARTMapEntry entry = {
+            .iova = DART_MAP_ENTRY_BYPASS,
+            .pte = o->s->bypass_address,
+        };
+
+        g_array_append_val(entries, entry);
+    } else {
+        apple_dart_pt_walk(o, sid, apple_dart_collect_one, entries);
+    }
+    return entries;
+}
+
+static bool apple_dart_map_snapshot_equal(GArray *a, GArray *b)
+{
+    return a && b && a->len == b->len &&
+           !memcmp(a->data, b->data, a->len * sizeof(AppleDARTMapEntry));
+}
+
+static void apple_dart_notify_snapshot(AppleDARTInstance *o, uint32_t sid,
+                                       GArray *entries)
+{
+    for (guint i = 0; i < entries->len; i++) {
+        AppleDARTMapEntry *entry =
+            &g_array_index(entries, AppleDARTMapEntry, i);
+
+        if (entry->iova == DART_MAP_ENTRY_BYPASS) {
+            apple_dart_map_bypass(o, sid, NULL);
+        } else {
+            apple_dart_map_one(o, sid, entry->iova, entry->pte, NULL);
+        }
+    }
+}
+
 static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
                            unsigned size)
 {
@@ -232,35 +547,75 @@ static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
         switch (addr) {
         case DART_TLB_OP:
             if (val & DART_TLB_OP_INVALIDATE) {
-                IOMMUTLBEvent event;
+                GList *stale[DART_MAX_STREAMS] = { 0 };
+                GArray *snapshot[DART_MAX_STREAMS] = { 0 };
                 uint64_t sid_mask = o->sid_mask;
+                uint64_t unchanged = 0;
                 int i;
 
                 if (qatomic_read(&o->tlb_op) & DART_TLB_OP_BUSY) {
                     return;
                 }
                 qatomic_or(&o->tlb_op, DART_TLB_OP_BUSY);
-                qemu_mutex_lock(&o->mutex);
 
+                /*
+                 * MAP notifiers already hold every translation of a SID
+                 * whose leaf entries are identical to what they were last
+                 * sent, so those SIDs don't need to be torn down and
+                 * replayed.
+                 */
                 for (i = 0; i < DART_MAX_STREAMS; i++) {
-                    if ((sid_mask & (1ULL << i)) && o->iommus[i]) {
-                        event.type = IOMMU_NOTIFIER_UNMAP;
-                        event.entry.target_as = &address_space_memory;
-                        event.entry.iova = 0;
-                        event.entry.perm = IOMMU_NONE;
-                        event.entry.addr_mask = ~(hwaddr)0;
-
-                        memory_region_notify_iommu(
-                            IOMMU_MEMORY_REGION(o->iommus[i]), 0, event);
+                    if (!(sid_mask & (1ULL << i)) || !o->iommus[i] ||
+                        !(o->iommus[i]->notifier_flags & IOMMU_NOTIFIER_MAP)) {
+                        continue;
+                    }
+                    snapshot[i] = apple_dart_map_snapshot(o, i);
+                    if (apple_dart_map_snapshot_equal(
+                            snapshot[i], o->iommus[i]->map_snapshot)) {
+                        unchanged |= 1ULL << i;
+                    }
+                }
+
+                WITH_QEMU_LOCK_GUARD(&o->mutex)
+                {
+                    for (i = 0; i < DART_MAX_STREAMS; i++) {
+                        if (!(sid_mask & (1ULL << i))) {
+                            continue;
+                        }
+                        apple_dart_tlb_flush(&o->tlb[i]);
+                        if (!(unchanged & (1ULL << i))) {
+                            stale[i] = o->mapped[i];
+                            o->mapped[i] = NULL;
+                        }
                     }
                 }
 
-                g_hash_table_foreach_remove(
-                    o->tlb, apple_dart_tlb_remove_by_sid_mask, &sid_mask);
+                /*
+                 * Notifiers may translate again, so they must be called
+                 * without the instance mutex held.
+                 */
+                for (i = 0; i < DART_MAX_STREAMS; i++) {
+                    if (!(sid_mask & (1ULL << i)) || !o->iommus[i]) {
+                        continue;
+                    }
+                    if (unchanged & (1ULL << i)) {
+                        g_array_free(snapshot[i], true);
+                        continue;
+                    }
+                    apple_dart_notify_unmap(o, i, stale[i]);
+                    g_list_free_full(stale[i], g_free);
+                    if (snapshot[i]) {
+                        apple_dart_notify_snapshot(o, i, snapshot[i]);
+                    }
+                    if (o->iommus[i]->map_snapshot) {
+                        g_array_free(o->iommus[i]->map_snapshot, true);
+                    }
+                    o->iommus[i]->map_snapshot = snapshot[i];
+                }
+
                 val &= ~(DART_TLB_OP_INVALIDATE | DART_TLB_OP_BUSY);
                 qatomic_and(&o->tlb_op,
                             ~(DART_TLB_OP_INVALIDATE | DART_TLB_OP_BUSY));
-                qemu_mutex_unlock(&o->mutex);
                 return;
             }
             break;
@@ -305,15 +660,15 @@ static const MemoryRegionOps base_reg_ops = {
     .valid.unaligned = false,
 };
 
-static AppleDARTTLBEntry *apple_dart_ptw(AppleDARTInstance *o, uint32_t sid,
-                                         hwaddr iova, uint32_t *error_status)
+static bool apple_dart_ptw(AppleDARTInstance *o, uint32_t sid, hwaddr iova,
+                           AppleDARTTLBEntry *tlb_entry, uint32_t *error_status)
 {
     AppleDARTState *s = o->s;
 
     uint64_t idx = (iova & (s->l_mask[0])) >> s->l_shift[0];
     uint64_t pte, pa;
     int level;
-    AppleDARTTLBEntry *tlb_entry = NULL;
+    bool found = false;
     uint32_t err_status = 0;
 
     if ((idx >= DART_MAX_TTBR) ||
@@ -349,10 +704,11 @@ static AppleDARTTLBEntry *apple_dart_ptw(AppleDARTInstance *o, uint32_t sid,
     }
 
     if ((pte & DART_TTE_VALID)) {
-        tlb_entry = g_new0(AppleDARTTLBEntry, 1);
+        tlb_entry->iova = iova;
         tlb_entry->block_addr = (pte & s->page_mask & DART_TTE_ADDR_MASK);
         tlb_entry->perm = IOMMU_ACCESS_FLAG(!(pte & DART_TTE_NO_READ),
                                             !(pte & DART_TTE_NO_WRITE));
+        found = true;
     } else {
         err_status = (DART_ERROR_FLAG | DART_ERROR_PTE_INVLD);
     }
@@ -360,7 +716,17 @@ end:
     if (error_status) {
         *error_status = err_status;
     }
-    return tlb_entry;
+    return found;
+}
+
+static void apple_dart_record_fault(AppleDARTInstance *o, uint32_t sid,
+                                    hwaddr addr, uint32_t status)
+{
+    QEMU_LOCK_GUARD(&o->mutex);
+    o->error_status |= status;
+    o->error_status = deposit32(o->error_status, DART_ERROR_STREAM_SHIFT,
+                                DART_ERROR_STREAM_LENGTH, sid);
+    o->error_address = addr;
 }
 
 static int apple_dart_attrs_to_index(IOMMUMemoryRegion *iommu, MemTxAttrs attrs)
@@ -374,9 +740,12 @@ static IOMMUTLBEntry apple_dart_translate(IOMMUMemoryRegion *mr, hwaddr addr,
     AppleDARTIOMMUMemoryRegion *iommu = APPLE_DART_IOMMU_MEMORY_REGION(mr);
     AppleDARTInstance *o = iommu->o;
     AppleDARTState *s = o->s;
-    AppleDARTTLBEntry *tlb_entry = NULL;
+    AppleDARTTLB *tlb;
+    AppleDARTTLBEntry tlb_entry;
     uint32_t sid = iommu->sid;
-    uint64_t iova, key;
+    uint32_t status = 0;
+    uint64_t iova;
+    bool found;
 
     IOMMUTLBEntry entry = {
         .target_as = &address_space_memory,
@@ -387,66 +756,87 @@ static IOMMUTLBEntry apple_dart_translate(IOMMUMemoryRegion *mr, hwaddr addr,
     };
 
     g_assert_cmpuint(sid, <, DART_MAX_STREAMS);
-    qemu_mutex_lock(&o->mutex);
-    sid = o->remap[sid] & 0xf;
+    sid = qatomic_read(&o->remap[sid]) & 0xf;
 
     if (s->bypass & (1 << sid)) {
-        goto end;
+        goto bypass;
     }
 
     if ((o->tcr[sid] & DART_TCR_TXEN) == 0) {
         /* Disabled translation goto bypass address, not error */
         entry.perm = IOMMU_RW;
-        goto end;
+        goto bypass;
     }
 
     if (o->tcr[sid] & DART_TCR_BYPASS_DART) {
         entry.perm = IOMMU_RW;
-        goto end;
+        goto bypass;
     }
 
     iova = addr >> s->page_shift;
-    key = DART_IOTLB_SID(iommu->sid) | iova;
-
-    tlb_entry = g_hash_table_lookup(o->tlb, GUINT_TO_POINTER(key));
-
-    if (tlb_entry == NULL) {
-        uint32_t status = 0;
-        tlb_entry = apple_dart_ptw(o, sid, iova, &status);
-        if (tlb_entry) {
-            g_hash_table_insert(o->tlb, GUINT_TO_POINTER(key), tlb_entry);
-            DPRINTF("%s[%d]: (%s) SID %u: 0x" HWADDR_FMT_plx
-                    " -> 0x" HWADDR_FMT_plx " (%c%c)\n",
-                    s->name, o->id, dart_instance_name[o->type], iommu->sid,
-                    addr, tlb_entry->block_addr | (addr & s->page_bits),
-                    (tlb_entry->perm & IOMMU_RO) ? 'r' : '-',
-                    (tlb_entry->perm & IOMMU_WO) ? 'w' : '-');
-        } else {
-            o->error_status |= status;
-            o->error_status =
-                deposit32(o->error_status, DART_ERROR_STREAM_SHIFT,
-                          DART_ERROR_STREAM_LENGTH, iommu->sid);
-            o->error_address = addr;
+    tlb = &o->tlb[iommu->sid];
+
+    found = apple_dart_tlb_lookup(tlb, iova, &tlb_entry);
+    if (found) {
+        stat64_add(&o->tlb_hits, 1);
+    } else {
+        stat64_add(&o->tlb_misses, 1);
+
+        WITH_QEMU_LOCK_GUARD(&o->mutex)
+        {
+            /* Another thread may have filled the entry while we waited. */
+            found = apple_dart_tlb_lookup(tlb, iova, &tlb_entry);
+            if (!found) {
+                stat64_add(&o->ptw_walks, 1);
+                found = apple_dart_ptw(o, sid, iova, &tlb_entry, &status);
+                if (found) {
+                    /*
+                     * The TLB is flushed whenever notifiers get attached, so
+                     * tracking the fill here also covers later hits.
+                     */
+                    apple_dart_tlb_insert(tlb, &tlb_entry);
+                    if (iommu->notifier_flags != IOMMU_NOTIFIER_NONE) {
+                        apple_dart_track_range(o, iommu->sid,
+                                               iova << s->page_shift,
+                                               s->page_bits);
+                    }
+                    DPRINTF("%s[%d]: (%s) SID %u: 0x" HWADDR_FMT_plx
+                            " -> 0x" HWADDR_FMT_plx " (%c%c)\n",
+                            s->name, o->id, dart_instance_name[o->type],
+                            iommu->sid, addr,
+                            tlb_entry.block_addr | (addr & s->page_bits),
+                            (tlb_entry.perm & IOMMU_RO) ? 'r' : '-',
+                            (tlb_entry.perm & IOMMU_WO) ? 'w' : '-');
+                } else {
+                    stat64_add(&o->ptw_faults, 1);
+                }
+            }
         }
     }
-    if (tlb_entry) {
-        entry.translated_addr =
-            tlb_entry->block_addr | (addr & entry.addr_mask);
-        entry.perm = tlb_entry->perm;
+    if (found) {
+        entry.translated_addr = tlb_entry.block_addr | (addr & entry.addr_mask);
+        entry.perm = tlb_entry.perm;
     }
 
     if ((flag & IOMMU_WO) && !(entry.perm & IOMMU_WO)) {
-        o->error_address = addr;
-        o->error_status |= (DART_ERROR_FLAG | DART_ERROR_WRITE_PROT);
-        o->error_status = deposit32(o->error_status, DART_ERROR_STREAM_SHIFT,
-                                    DART_ERROR_STREAM_LENGTH, iommu->sid);
+        status |= (DART_ERROR_FLAG | DART_ERROR_WRITE_PROT);
     }
 
     if ((flag & IOMMU_RO) && !(entry.perm & IOMMU_RO)) {
-        o->error_address = addr;
-        o->error_status |= (DART_ERROR_FLAG | DART_ERROR_READ_PROT);
-        o->error_status = deposit32(o->error_status, DART_ERROR_STREAM_SHIFT,
-                                    DART_ERROR_STREAM_LENGTH, iommu->sid);
+        status |= (DART_ERROR_FLAG | DART_ERROR_READ_PROT);
+    }
+
+    if (status) {
+        apple_dart_record_fault(o, iommu->sid, addr, status);
+        apple_dart_update_irq(s);
+    }
+    goto end;
+
+bypass:
+    if (qatomic_read(&iommu->notifier_flags) != IOMMU_NOTIFIER_NONE) {
+        QEMU_LOCK_GUARD(&o->mutex);
+        apple_dart_track_range(o, iommu->sid, addr & ~s->page_bits,
+                               s->page_bits);
     }
 
 end:
@@ -455,11 +845,46 @@ end:
             s->name, o->id, dart_instance_name[o->type], iommu->sid, entry.iova,
             entry.translated_addr, (entry.perm & IOMMU_RO) ? 'r' : '-',
             (entry.perm & IOMMU_WO) ? 'w' : '-');
-    qemu_mutex_unlock(&o->mutex);
-    apple_dart_update_irq(s);
     return entry;
 }
 
+static int apple_dart_notify_flag_changed(IOMMUMemoryRegion *mr,
+                                         IOMMUNotifierFlag old,
+                                         IOMMUNotifierFlag new, Error **errp)
+{
+    AppleDARTIOMMUMemoryRegion *iommu = APPLE_DART_IOMMU_MEMORY_REGION(mr);
+
+    if (new & IOMMU_NOTIFIER_DEVIOTLB_UNMAP) {
+        error_setg(errp, "Apple DART does not support dev-iotlb notifiers");
+        return -EINVAL;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&iommu->o->mutex)
+    {
+        /*
+         * Translations cached while nobody was listening were never
+         * tracked, so they must be walked again to get unmapped later.
+         */
+        if (old == IOMMU_NOTIFIER_NONE) {
+            apple_dart_tlb_flush(&iommu->o->tlb[iommu->sid]);
+        }
+        qatomic_set(&iommu->notifier_flags, new);
+    }
+
+    if (!(new & IOMMU_NOTIFIER_MAP) && iommu->map_snapshot) {
+        g_array_free(iommu->map_snapshot, true);
+        iommu->map_snapshot = NULL;
+    }
+    return 0;
+}
+
+static void apple_dart_replay(IOMMUMemoryRegion *mr, IOMMUNotifier *n)
+{
+    AppleDARTIOMMUMemoryRegion *iommu = APPLE_DART_IOMMU_MEMORY_REGION(mr);
+
+    apple_dart_notify_map_one(iommu->o, iommu->sid, n);
+}
+
 static void apple_dart_reset(DeviceState *dev)
 {
     AppleDARTState *s = APPLE_DART(dev);
@@ -476,12 +901,19 @@ static void apple_dart_reset(DeviceState *dev)
 
             WITH_QEMU_LOCK_GUARD(&s->instances[i].mutex)
             {
-                if (s->instances[i].tlb) {
-                    g_hash_table_destroy(s->instances[i].tlb);
-                    s->instances[i].tlb = NULL;
+                for (j = 0; j < DART_MAX_STREAMS; j++) {
+                    apple_dart_tlb_flush(&s->instances[i].tlb[j]);
+                    g_list_free_full(s->instances[i].mapped[j], g_free);
+                    s->instances[i].mapped[j] = NULL;
+                }
+            }
+            for (j = 0; j < DART_MAX_STREAMS; j++) {
+                AppleDARTIOMMUMemoryRegion *iommu = s->instances[i].iommus[j];
+
+                if (iommu && iommu->map_snapshot) {
+                    g_array_free(iommu->map_snapshot, true);
+                    iommu->map_snapshot = NULL;
                 }
-                s->instances[i].tlb = g_hash_table_new_full(
-                    g_direct_hash, g_direct_equal, NULL, g_free);
             }
         }
         default:
@@ -600,8 +1032,10 @@ AppleDARTState *apple_dart_create(DTBNode *node)
         case 'DART': {
             int i;
             o->type = DART_DART;
+            qemu_mutex_init(&o->mutex);
 
             for (i = 0; i < DART_MAX_STREAMS; i++) {
+                seqlock_init(&o->tlb[i].seq);
                 if ((1 << i) & s->sids) {
                     g_autofree char *name =
                         g_strdup_printf("%s-%d-%d", s->name, o->id, i);
@@ -612,8 +1046,6 @@ AppleDARTState *apple_dart_create(DTBNode *node)
                         o->iommus[i], sizeof(AppleDARTIOMMUMemoryRegion),
                         TYPE_APPLE_DART_IOMMU_MEMORY_REGION, OBJECT(s), name,
                         1ULL << DART_MAX_VA_BITS);
-
-                    qemu_mutex_init(&o->mutex);
                 }
             }
             break;
@@ -714,6 +1146,11 @@ void hmp_info_dart(Monitor *mon, const QDict *qdict)
         if (o->type != DART_DART) {
             continue;
         }
+        monitor_printf(mon,
+                       "\t\tTLB: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+                       " walks, %" PRIu64 " faults\n",
+                       stat64_get(&o->tlb_hits), stat64_get(&o->tlb_misses),
+                       stat64_get(&o->ptw_walks), stat64_get(&o->ptw_faults));
 
         for (int sid = 0; sid < DART_MAX_STREAMS; sid++) {
             if (dart->sids & (1 << sid)) {
@@ -786,6 +1223,8 @@ static void apple_dart_iommu_memory_region_class_init(ObjectClass *klass,
 
     imrc->translate = apple_dart_translate;
     imrc->attrs_to_index = apple_dart_attrs_to_index;
+    imrc->notify_flag_changed = apple_dart_notify_flag_changed;
+    imrc->replay = apple_dart_replay;
 }
 
 static const TypeInfo apple_dart_info = {
@@ -37,6 +37,26 @@ static void *align_4_high_ptr(void *ptr)
     return (void *)align_4_high_num((uint64_t)ptr);
 }
 
+static void dtb_node_invalidate_size(DTBNode *node)
+{
+    for (; node != NULL && node->buffer_size != 0; node = node->parent) {
+        node->buffer_size = 0;
+    }
+}
+
+static void dtb_node_drop_child_index(DTBNode *node)
+{
+    if (node != NULL && node->child_index != NULL) {
+        g_hash_table_destroy(node->child_index);
+        node->child_index = NULL;
+    }
+}
+
+static bool dtb_prop_is_name(DTBProp *prop)
+{
+    return strncmp((const char *)prop->name, "name", DTB_PROP_NAME_LEN) == 0;
+}
+
 static DTBProp *read_dtb_prop(uint8_t **dtb_blob)
 {
     g_assert_nonnull(dtb_blob);
@@ -95,14 +115,17 @@ static DTBNode *read_dtb_node(uint8_t **dtb_blob)
     for (i = 0; i < node->prop_count; i++) {
         prop = read_dtb_prop(dtb_blob);
         g_assert_nonnull(prop);
-        node->props = g_list_append(node->props, prop);
+        node->props = g_list_prepend(node->props, prop);
     }
+    node->props = g_list_reverse(node->props);
 
     for (i = 0; i < node->child_node_count; i++) {
         child = read_dtb_node(dtb_blob);
         g_assert_nonnull(child);
-        node->child_nodes = g_list_append(node->child_nodes, child);
+        child->parent = node;
+        node->child_nodes = g_list_prepend(node->child_nodes, child);
     }
+    node->child_nodes = g_list_reverse(node->child_nodes);
 
     return node;
 }
@@ -119,6 +142,11 @@ static void delete_dtb_node(DTBNode *node)
         g_list_free_full(node->child_nodes, (GDestroyNotify)delete_dtb_node);
     }
 
+    if (node->prop_index != NULL) {
+        g_hash_table_destroy(node->prop_index);
+    }
+
+    dtb_node_drop_child_index(node);
     g_free(node);
 }
 
@@ -181,6 +209,8 @@ void remove_dtb_node(DTBNode *parent, DTBNode *node)
         g_assert_cmpuint(parent->child_node_count, >, 0);
 
         parent->child_node_count--;
+        dtb_node_drop_child_index(parent);
+        dtb_node_invalidate_size(parent);
         return;
     }
 
@@ -213,12 +243,20 @@ void remove_dtb_prop(DTBNode *node, DTBProp *prop)
 
     for (iter = node->props; iter != NULL; iter = iter->next) {
         if (prop == iter->data) {
+            if (dtb_prop_is_name(prop)) {
+                dtb_node_drop_child_index(node->parent);
+            }
+            if (node->prop_index != NULL) {
+                g_hash_table_destroy(node->prop_index);
+                node->prop_index = NULL;
+            }
             delete_prop(prop);
             node->props = g_list_delete_link(node->props, iter);
 
             g_assert_cmpuint(node->prop_count, >, 0);
 
             node->prop_count--;
+            dtb_node_invalidate_size(node);
             return;
         }
     }
@@ -238,18 +276,32 @@ DTBProp *set_dtb_prop(DTBNode *node, const char *name, const uint32_t size,
 
     if (prop == NULL) {
         prop = g_new0(DTBProp, 1);
+        strncpy((char *)prop->name, name, DTB_PROP_NAME_LEN);
         node->props = g_list_append(node->props, prop);
         node->prop_count++;
+        dtb_node_invalidate_size(node);
+        if (node->prop_index != NULL) {
+            g_hash_table_insert(node->prop_index,
+                                g_strndup((const char *)prop->name,
+                                          DTB_PROP_NAME_LEN),
+                                prop);
+        }
     } else {
         g_free(prop->value);
         prop->value = NULL;
-        memset(prop, 0, sizeof(DTBProp));
+        prop->flags = 0;
+    }
+    if (prop->length != size) {
+        prop->length = size;
+        dtb_node_invalidate_size(node);
     }
-    strncpy((char *)prop->name, name, DTB_PROP_NAME_LEN);
-    prop->length = size;
     prop->value = g_malloc0(size);
     memcpy(prop->value, val, size);
 
+    if (dtb_prop_is_name(prop)) {
+        dtb_node_drop_child_index(node->parent);
+    }
+
     return prop;
 }
 
@@ -282,6 +334,10 @@ uint64_t get_dtb_node_buffer_size(DTBNode *node)
     DTBNode *child;
     GList *iter;
 
+    if (node->buffer_size != 0) {
+        return node->buffer_size;
+    }
+
     size = sizeof(node->prop_count) + sizeof(node->child_node_count);
 
     for (iter = node->props; iter != NULL; iter = iter->next) {
@@ -296,72 +352,106 @@ uint64_t get_dtb_node_buffer_size(DTBNode *node)
         size += get_dtb_node_buffer_size(child);
     }
 
+    node->buffer_size = size;
     return size;
 }
 
-DTBProp *find_dtb_prop(DTBNode *node, const char *name)
+static void build_prop_index(DTBNode *node)
 {
     GList *iter;
     DTBProp *prop;
+    char *key;
 
-    g_assert_nonnull(node);
-    g_assert_nonnull(name);
+    node->prop_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                             NULL);
 
     for (iter = node->props; iter; iter = iter->next) {
         prop = (DTBProp *)iter->data;
 
         g_assert_nonnull(prop);
 
-        if (strncmp((const char *)prop->name, name, DTB_PROP_NAME_LEN) == 0) {
-            return prop;
+        key = g_strndup((const char *)prop->name, DTB_PROP_NAME_LEN);
+
+        // keep the first match, as the linear lookup did
+        if (g_hash_table_contains(node->prop_index, key)) {
+            g_free(key);
+        } else {
+            g_hash_table_insert(node->prop_index, key, prop);
         }
     }
-
-    return NULL;
 }
 
-DTBNode *find_dtb_node(DTBNode *node, const char *path)
+DTBProp *find_dtb_prop(DTBNode *node, const char *name)
 {
+    g_autofree char *key = NULL;
+
     g_assert_nonnull(node);
-    g_assert_nonnull(path);
+    g_assert_nonnull(name);
 
+    if (node->prop_index == NULL) {
+        build_prop_index(node);
+    }
+
+    if (strnlen(name, DTB_PROP_NAME_LEN) == DTB_PROP_NAME_LEN) {
+        key = g_strndup(name, DTB_PROP_NAME_LEN);
+        name = key;
+    }
+
+    return g_hash_table_lookup(node->prop_index, name);
+}
+
+static void build_child_index(DTBNode *node)
+{
     GList *iter;
     DTBProp *prop;
     DTBNode *child;
-    char *s;
-    const char *next;
-    bool found;
 
-    s = g_strdup(path);
+    node->child_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                              NULL);
 
-    while (node != NULL && ((next = qemu_strsep(&s, "/")))) {
-        if (strlen(next) == 0) {
+    for (iter = node->child_nodes; iter; iter = iter->next) {
+        child = (DTBNode *)iter->data;
+
+        g_assert_nonnull(child);
+
+        prop = find_dtb_prop(child, "name");
+
+        if (prop == NULL) {
             continue;
         }
 
-        found = false;
+        // the last sibling with a given name wins, as the linear lookup did
+        g_hash_table_replace(
+            node->child_index,
+            g_strndup((const char *)prop->value, prop->length), child);
+    }
+}
 
-        for (iter = node->child_nodes; iter; iter = iter->next) {
-            child = (DTBNode *)iter->data;
+static DTBNode *find_dtb_child(DTBNode *node, const char *name)
+{
+    if (node->child_index == NULL) {
+        build_child_index(node);
+    }
 
-            g_assert_nonnull(child);
+    return g_hash_table_lookup(node->child_index, name);
+}
+
+DTBNode *find_dtb_node(DTBNode *node, const char *path)
+{
+    g_assert_nonnull(node);
+    g_assert_nonnull(path);
 
-            prop = find_dtb_prop(child, "name");
+    char *s;
+    const char *next;
 
-            if (prop == NULL) {
-                continue;
-            }
+    s = g_strdup(path);
 
-            if (strncmp((const char *)prop->value, next, prop->length) == 0) {
-                node = child;
-                found = true;
-            }
+    while (node != NULL && ((next = qemu_strsep(&s, "/")))) {
+        if (strlen(next) == 0) {
+            continue;
         }
 
-        if (!found) {
-            g_free(s);
-            return NULL;
-        }
+        node = find_dtb_child(node, next);
     }
 
     g_free(s);
@@ -373,12 +463,9 @@ DTBNode *get_dtb_node(DTBNode *node, const char *path)
     g_assert_nonnull(node);
     g_assert_nonnull(path);
 
-    GList *iter = NULL;
-    DTBProp *prop = NULL;
     DTBNode *child = NULL;
     char *s;
     const char *name;
-    bool found;
     size_t name_len;
 
     s = g_strdup(path);
@@ -389,33 +476,20 @@ DTBNode *get_dtb_node(DTBNode *node, const char *path)
             continue;
         }
 
-        found = false;
+        child = find_dtb_child(node, name);
 
-        for (iter = node->child_nodes; iter; iter = iter->next) {
-            child = (DTBNode *)iter->data;
-
-            g_assert_nonnull(child);
-
-            prop = find_dtb_prop(child, "name");
-
-            if (prop == NULL) {
-                continue;
-            }
-
-            if (strncmp((const char *)prop->value, name, prop->length) == 0) {
-                node = child;
-                found = true;
-            }
-        }
-
-        if (!found) {
-            DTBNode *child = g_new0(DTBNode, 1);
+        if (child == NULL) {
+            child = g_new0(DTBNode, 1);
 
+            child->parent = node;
             set_dtb_prop(child, "name", name_len + 1, (uint8_t *)name);
             node->child_nodes = g_list_append(node->child_nodes, child);
             node->child_node_count++;
-            node = child;
+            dtb_node_drop_child_index(node);
+            dtb_node_invalidate_size(node);
         }
+
+        node = child;
     }
 
     g_free(s);
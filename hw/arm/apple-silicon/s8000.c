@@ -265,8 +265,10 @@ static void s8000_load_classic_kc(S8000MachineState *s8000_machine,
     // RAM disk
     if (machine->initrd_filename) {
         info->ramdisk_addr = phys_ptr;
-        macho_load_ramdisk(machine->initrd_filename, nsas, sysmem,
-                           info->ramdisk_addr, &info->ramdisk_size);
+        macho_load_ramdisk(machine->initrd_filename,
+                           s8000_machine->payload_cache, nsas, sysmem,
+                           info->ramdisk_addr, &s8000_machine->ramdisk_mr,
+                           &info->ramdisk_size);
         info->ramdisk_size = align_16k_high(info->ramdisk_size);
         phys_ptr += info->ramdisk_size;
     }
@@ -1200,7 +1202,8 @@ static void s8000_machine_init(MachineState *machine)
                              S8000_SEPROM_SIZE);
     memory_region_add_subregion_overlap(s8000_machine->sysmem, 0, mr, 1);
 
-    hdr = macho_load_file(machine->kernel_filename, &secure_monitor);
+    hdr = macho_load_file(machine->kernel_filename,
+                          s8000_machine->payload_cache, &secure_monitor);
     g_assert_nonnull(hdr);
     g_assert_nonnull(secure_monitor);
     s8000_machine->kernel = hdr;
@@ -1220,9 +1223,11 @@ static void s8000_machine_init(MachineState *machine)
 
     s8000_patch_kernel(hdr);
 
-    s8000_machine->device_tree = load_dtb_from_file(machine->dtb);
+    s8000_machine->device_tree =
+        load_dtb_from_file(machine->dtb, s8000_machine->payload_cache);
     s8000_machine->trustcache =
         load_trustcache_from_file(s8000_machine->trustcache_filename,
+                                  s8000_machine->payload_cache,
                                   &s8000_machine->bootinfo.trustcache_size);
     data = 24000000;
     set_dtb_prop(s8000_machine->device_tree, "clock-frequency", sizeof(data),
@@ -1372,6 +1377,24 @@ static char *s8000_get_trustcache_filename(Object *obj, Error **errp)
     return g_strdup(s8000_machine->trustcache_filename);
 }
 
+static void s8000_set_payload_cache(Object *obj, const char *value,
+                                    Error **errp)
+{
+    S8000MachineState *s8000_machine;
+
+    s8000_machine = S8000_MACHINE(obj);
+    g_free(s8000_machine->payload_cache);
+    s8000_machine->payload_cache = g_strdup(value);
+}
+
+static char *s8000_get_payload_cache(Object *obj, Error **errp)
+{
+    S8000MachineState *s8000_machine;
+
+    s8000_machine = S8000_MACHINE(obj);
+    return g_strdup(s8000_machine->payload_cache);
+}
+
 static void s8000_set_ticket_filename(Object *obj, const char *value,
                                       Error **errp)
 {
@@ -1529,6 +1552,12 @@ static void s8000_machine_class_init(ObjectClass *klass, void *data)
                                   s8000_set_trustcache_filename);
     object_class_property_set_description(klass, "trustcache",
                                           "Trustcache to be loaded");
+    object_class_property_add_str(klass, "payload-cache",
+                                  s8000_get_payload_cache,
+                                  s8000_set_payload_cache);
+    object_class_property_set_description(
+        klass, "payload-cache",
+        "Directory to cache decoded kernelcache and IMG4 payloads in");
     object_class_property_add_str(klass, "ticket", s8000_get_ticket_filename,
                                   s8000_set_ticket_filename);
     object_class_property_set_description(klass, "ticket",
@@ -2,6 +2,7 @@
 #include "exec/address-spaces.h"
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/arm/apple-silicon/sart.h"
+#include "qemu/host-utils.h"
 #include "qemu/module.h"
 
 // #define DEBUG_SART
@@ -31,11 +32,19 @@ typedef struct AppleSARTRegion {
     uint32_t flags;
 } AppleSARTRegion;
 
+// Enabled regions in bytes, rebuilt whenever a region register changes.
+typedef struct AppleSARTWindow {
+    hwaddr start;
+    hwaddr end;
+} AppleSARTWindow;
+
 struct AppleSARTState {
     SysBusDevice parent_obj;
     MemoryRegion iomem;
     AppleSARTIOMMUMemoryRegion iommu;
     AppleSARTRegion regions[SART_NUM_REGIONS];
+    AppleSARTWindow windows[SART_NUM_REGIONS];
+    int nr_windows;
     uint32_t version;
     uint32_t reg[0x8000 / sizeof(uint32_t)];
 };
@@ -95,16 +104,59 @@ static inline uint32_t sart_get_region_flags(AppleSARTState *s, int region)
     }
 }
 
+static void apple_sart_notify_unmap(AppleSARTState *s, hwaddr start,
+                                    hwaddr end)
+{
+    IOMMUTLBEvent event;
+
+    event.type = IOMMU_NOTIFIER_UNMAP;
+    event.entry.target_as = &address_space_memory;
+    event.entry.perm = IOMMU_NONE;
+
+    // Split the range into the largest naturally aligned blocks.
+    while (start < end) {
+        hwaddr size = start ? (start & -start) : pow2floor(end);
+
+        while (start + size > end) {
+            size >>= 1;
+        }
+
+        event.entry.iova = start;
+        event.entry.translated_addr = start;
+        event.entry.addr_mask = size - 1;
+        memory_region_notify_iommu(IOMMU_MEMORY_REGION(&s->iommu), 0, event);
+        start += size;
+    }
+}
+
+static void apple_sart_update_windows(AppleSARTState *s)
+{
+    s->nr_windows = 0;
+
+    for (int i = 0; i < SART_NUM_REGIONS; i++) {
+        if (!s->regions[i].flags || !s->regions[i].size) {
+            continue;
+        }
+
+        s->windows[s->nr_windows].start = s->regions[i].addr << 12;
+        s->windows[s->nr_windows].end =
+            (s->regions[i].addr + s->regions[i].size) << 12;
+        s->nr_windows++;
+    }
+}
+
 static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
                            unsigned size)
 {
     AppleSARTState *s = APPLE_SART(opaque);
-    uint32_t orig;
     uint32_t val = data;
+    bool changed = false;
     DPRINTF("%s: %s @ 0x" HWADDR_FMT_plx " value: 0x" HWADDR_FMT_plx "\n",
             DEVICE(s)->id, __func__, addr, data);
 
-    orig = s->reg[addr >> 2];
+    if (s->reg[addr >> 2] == val) {
+        return;
+    }
 
     s->reg[addr >> 2] = val;
 
@@ -112,23 +164,19 @@ static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
         if ((sart_get_region_addr(s, i) != s->regions[i].addr) ||
             (sart_get_region_size(s, i) != s->regions[i].size) ||
             (sart_get_region_flags(s, i) != s->regions[i].flags)) {
-            hwaddr curr = s->regions[i].addr;
-            for (curr = s->regions[i].addr;
-                 curr < s->regions[i].addr + s->regions[i].size; curr++) {
-                IOMMUTLBEvent event;
-                event.type = IOMMU_NOTIFIER_UNMAP;
-                event.entry.target_as = &address_space_memory;
-                event.entry.iova = curr << 12;
-                event.entry.perm = IOMMU_NONE;
-                event.entry.addr_mask = 0xFFF;
-                memory_region_notify_iommu(IOMMU_MEMORY_REGION(&s->iommu), 0,
-                                           event);
-            }
+            apple_sart_notify_unmap(
+                s, s->regions[i].addr << 12,
+                (s->regions[i].addr + s->regions[i].size) << 12);
             s->regions[i].addr = sart_get_region_addr(s, i);
             s->regions[i].size = sart_get_region_size(s, i);
             s->regions[i].flags = sart_get_region_flags(s, i);
+            changed = true;
         }
     }
+
+    if (changed) {
+        apple_sart_update_windows(s);
+    }
 }
 
 static uint64_t base_reg_read(void *opaque, hwaddr addr, unsigned size)
@@ -155,25 +203,35 @@ static IOMMUTLBEntry apple_sart_translate(IOMMUMemoryRegion *mr, hwaddr addr,
 {
     AppleSARTIOMMUMemoryRegion *iommu = APPLE_SART_IOMMU_MEMORY_REGION(mr);
     AppleSARTState *s = container_of(iommu, AppleSARTState, iommu);
+    hwaddr mask = 0xFFF;
+
+    // SART is an identity mapping, so hand out the largest naturally
+    // aligned block of the window that contains addr. This lets callers
+    // map a whole transfer with a single translation instead of one per
+    // page.
+    for (int i = 0; i < s->nr_windows; i++) {
+        AppleSARTWindow *w = &s->windows[i];
+
+        if (w->start <= addr && addr < w->end) {
+            while (mask < (1ULL << SART_MAX_VA_BITS) - 1) {
+                hwaddr next = (mask << 1) | 1;
+
+                if ((addr & ~next) < w->start || (addr | next) >= w->end) {
+                    break;
+                }
+                mask = next;
+            }
+            break;
+        }
+    }
 
-    IOMMUTLBEntry entry = {
+    return (IOMMUTLBEntry){
         .target_as = &address_space_memory,
-        .iova = addr & ~0xFFF,
-        .translated_addr = addr & ~0xFFF,
-        .addr_mask = 0xFFF,
+        .iova = addr & ~mask,
+        .translated_addr = addr & ~mask,
+        .addr_mask = mask,
         .perm = IOMMU_RW,
     };
-    addr >>= 12;
-
-    for (int i = 0; i < SART_NUM_REGIONS; i++) {
-        if ((s->regions[i].addr <= addr) &&
-            (addr < s->regions[i].addr + s->regions[i].size) &&
-            s->regions[i].flags) {
-            entry.perm = IOMMU_RW;
-            break;
-        }
-    }
-    return entry;
 }
 
 static void apple_sart_reset(DeviceState *dev)
@@ -181,6 +239,7 @@ static void apple_sart_reset(DeviceState *dev)
     AppleSARTState *s = APPLE_SART(dev);
     memset(s->reg, 0, sizeof(s->reg));
     memset(s->regions, 0, sizeof(s->regions));
+    apple_sart_update_windows(s);
 }
 
 SysBusDevice *apple_sart_create(DTBNode *node)
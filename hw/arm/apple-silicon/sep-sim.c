@@ -23,11 +23,16 @@
 #include "hw/arm/apple-silicon/sep-sim.h"
 #include "hw/misc/apple-silicon/a7iop/core.h"
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qemu/host-utils.h"
 #include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "sysemu/dma.h"
+#include "sysemu/runstate.h"
 #include "art.h"
 #include "libtasn1.h"
 
@@ -276,16 +281,77 @@ static void apple_sep_sim_set_ool_out_addr(AppleSEPSimState *s, uint8_t ep,
     s->ool_state[ep].out_addr = addr;
 }
 
+struct AppleSEPSimRequest {
+    uint64_t data[2];
+    int64_t queued_ns;
+    // OOL input, copied from guest memory when the request is queued.
+    uint8_t *in;
+    uint32_t in_size;
+    QTAILQ_ENTRY(AppleSEPSimRequest) entry;
+};
+
+struct AppleSEPSimWrite {
+    uint64_t addr;
+    uint8_t *data;
+    uint32_t size;
+    QTAILQ_ENTRY(AppleSEPSimWrite) entry;
+};
+
+static uint8_t *apple_sep_sim_grow_buf(uint8_t **buf, uint32_t *buf_size,
+                                       uint32_t size)
+{
+    if (*buf_size < size) {
+        g_free(*buf);
+        *buf_size = ROUND_UP(size, 0x1000);
+        *buf = g_malloc(*buf_size);
+    }
+    memset(*buf, 0, size);
+    return *buf;
+}
+
+static uint8_t *apple_sep_sim_ool_out_buf(AppleSEPSimState *s, uint8_t ep,
+                                          uint32_t size)
+{
+    g_assert_cmpuint(ep, <, SEP_ENDPOINT_MAX);
+    return apple_sep_sim_grow_buf(&s->ool_state[ep].out_buf,
+                                  &s->ool_state[ep].out_buf_size, size);
+}
+
+// Handlers run on the worker without the BQL, so replies are queued here
+// and delivered to the AP mailbox by `apple_sep_sim_reply_bh`.
+static void apple_sep_sim_post_reply(AppleSEPSimState *s,
+                                     AppleA7IOPMessage *msg)
+{
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        QTAILQ_INSERT_TAIL(&s->replies, msg, entry);
+    }
+}
+
+// OOL output is written by `apple_sep_sim_reply_bh` under the BQL, before
+// any reply posted after it.
+static void apple_sep_sim_post_write(AppleSEPSimState *s, uint64_t addr,
+                                     const void *data, uint32_t size)
+{
+    AppleSEPSimWrite *write;
+
+    write = g_new0(AppleSEPSimWrite, 1);
+    write->addr = addr;
+    write->data = g_memdup2(data, size);
+    write->size = size;
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        QTAILQ_INSERT_TAIL(&s->writes, write, entry);
+    }
+}
+
 static void apple_sep_sim_send_message(AppleSEPSimState *s, uint8_t ep,
                                        uint8_t tag, uint8_t op, uint8_t param,
                                        uint32_t data)
 {
-    AppleA7IOP *a7iop;
     AppleA7IOPMessage *sent_msg;
     SEPMessage *sent_sep_msg;
 
-    a7iop = APPLE_A7IOP(s);
-
     sent_msg = g_new0(AppleA7IOPMessage, 1);
     sent_sep_msg = (SEPMessage *)sent_msg->data;
     sent_sep_msg->ep = ep;
@@ -293,7 +359,7 @@ static void apple_sep_sim_send_message(AppleSEPSimState *s, uint8_t ep,
     sent_sep_msg->op = op;
     sent_sep_msg->param = param;
     sent_sep_msg->data = data;
-    apple_a7iop_send_ap(a7iop, sent_msg);
+    apple_sep_sim_post_reply(s, sent_msg);
 }
 
 static void apple_sep_sim_message_reply(AppleSEPSimState *s, SEPMessage *msg,
@@ -324,8 +390,6 @@ static void apple_sep_sim_handle_control_msg(AppleSEPSimState *s,
         qemu_log_mask(LOG_GUEST_ERROR,
                       "EP_CONTROL: SET_OOL_IN_ADDR (%d, 0x%llX)\n",
                       set_ool_msg->id, (uint64_t)set_ool_msg->data << 12);
-        apple_sep_sim_set_ool_in_addr(s, set_ool_msg->id,
-                                      (uint64_t)set_ool_msg->data << 12);
         apple_sep_sim_control_send_ack(s, msg, 0, 0);
         break;
     case CONTROL_OP_SET_OOL_OUT_ADDR:
@@ -333,8 +397,6 @@ static void apple_sep_sim_handle_control_msg(AppleSEPSimState *s,
         qemu_log_mask(LOG_GUEST_ERROR,
                       "EP_CONTROL: SET_OOL_OUT_ADDR (%d, 0x%llX)\n",
                       set_ool_msg->id, (uint64_t)set_ool_msg->data << 12);
-        apple_sep_sim_set_ool_out_addr(s, set_ool_msg->id,
-                                       (uint64_t)set_ool_msg->data << 12);
         apple_sep_sim_control_send_ack(s, msg, 0, 0);
         break;
     case CONTROL_OP_SET_OOL_IN_SIZE:
@@ -342,7 +404,6 @@ static void apple_sep_sim_handle_control_msg(AppleSEPSimState *s,
         qemu_log_mask(LOG_GUEST_ERROR,
                       "EP_CONTROL: SET_OOL_IN_SIZE (%d, 0x%X)\n",
                       set_ool_msg->id, set_ool_msg->data);
-        apple_sep_sim_set_ool_in_size(s, set_ool_msg->id, set_ool_msg->data);
         apple_sep_sim_control_send_ack(s, msg, 0, 0);
         break;
     case CONTROL_OP_SET_OOL_OUT_SIZE:
@@ -350,7 +411,6 @@ static void apple_sep_sim_handle_control_msg(AppleSEPSimState *s,
         qemu_log_mask(LOG_GUEST_ERROR,
                       "EP_CONTROL: SET_OOL_OUT_SIZE (%d, 0x%X)\n",
                       set_ool_msg->id, set_ool_msg->data);
-        apple_sep_sim_set_ool_out_size(s, set_ool_msg->id, set_ool_msg->data);
         apple_sep_sim_control_send_ack(s, msg, 0, 0);
         break;
     case CONTROL_OP_GET_SECURITY_MODE:
@@ -390,12 +450,8 @@ static void apple_sep_sim_handle_control_msg(AppleSEPSimState *s,
         asn1_delete_structure(&art);
         asn1_delete_structure(&art_defs);
 
-        if (dma_memory_write(s->dma_as, s->ool_state[EP_ART_STORAGE].out_addr,
-                             data, data_len,
-                             MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
-            qemu_log_mask(LOG_GUEST_ERROR,
-                          "EP_XART_STORAGE: Failed to write ART to OOL");
-        }
+        apple_sep_sim_post_write(s, s->ool_state[EP_ART_STORAGE].out_addr,
+                                 data, data_len);
         apple_sep_sim_send_message(s, EP_ART_STORAGE, 0,
                                    ART_STORAGE_OP_SEND_ART, 0, 0);
         break;
@@ -470,10 +526,6 @@ static void apple_sep_sim_handle_l4info(AppleSEPSimState *s, L4InfoMessage *msg)
 {
     qemu_log_mask(LOG_GUEST_ERROR, "EP_L4INFO: address 0x%llX size 0x%X\n",
                   (uint64_t)msg->address << 12, msg->size << 12);
-    s->ool_state[EP_CONTROL].in_addr = (uint64_t)msg->address << 12;
-    s->ool_state[EP_CONTROL].in_size = msg->size << 12;
-    s->ool_state[EP_CONTROL].out_addr = (uint64_t)msg->address << 12;
-    s->ool_state[EP_CONTROL].out_size = msg->size << 12;
 }
 
 static const uint8_t apple_sep_sim_eps[] = {
@@ -492,14 +544,11 @@ static const uint32_t apple_sep_sim_endpoint_names[] = {
 
 static void apple_sep_sim_advertise_eps(AppleSEPSimState *s)
 {
-    AppleA7IOP *a7iop;
     AppleA7IOPMessage *msg;
     EPAdvertisementMessage *ep_advert_msg;
     OOLAdvertisementMessage *ool_advert_msg;
     size_t i;
 
-    a7iop = APPLE_A7IOP(s);
-
     for (i = 0; i < (sizeof(apple_sep_sim_eps) / sizeof(*apple_sep_sim_eps));
          i++) {
         msg = g_new0(AppleA7IOPMessage, 1);
@@ -508,7 +557,7 @@ static void apple_sep_sim_advertise_eps(AppleSEPSimState *s)
         ep_advert_msg->op = DISCOVERY_OP_EP_ADVERT;
         ep_advert_msg->id = apple_sep_sim_eps[i];
         ep_advert_msg->name = apple_sep_sim_endpoint_names[i];
-        apple_a7iop_send_ap(a7iop, msg);
+        apple_sep_sim_post_reply(s, msg);
 
         msg = g_new0(AppleA7IOPMessage, 1);
         ool_advert_msg = (OOLAdvertisementMessage *)msg->data;
@@ -517,7 +566,7 @@ static void apple_sep_sim_advertise_eps(AppleSEPSimState *s)
         ool_advert_msg->id = apple_sep_sim_eps[i];
         memcpy(&ool_advert_msg->ool_info, s->ool_info + apple_sep_sim_eps[i],
                sizeof(AppleSEPSimOOLInfo));
-        apple_a7iop_send_ap(a7iop, msg);
+        apple_sep_sim_post_reply(s, msg);
     }
 }
 
@@ -564,8 +613,8 @@ static void apple_sep_sim_handle_bootstrap_msg(AppleSEPSimState *s,
     }
 }
 
-static uint8_t *apple_sep_sim_gen_sks_hash(uint8_t *buf,
-                                           const uint32_t msg_size)
+static void apple_sep_sim_gen_sks_hash(uint8_t *buf, const uint32_t msg_size,
+                                       uint8_t hash[32])
 {
     KeystoreIPCHeader *hdr;
 
@@ -581,15 +630,11 @@ static uint8_t *apple_sep_sim_gen_sks_hash(uint8_t *buf,
         },
     };
     g_assert_true(qcrypto_hash_supports(QCRYPTO_HASH_ALG_SHA256));
-    uint8_t *hash = NULL;
-    size_t hash_len = 0;
+    size_t hash_len = 32;
     g_assert_cmpuint(qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, iov,
                                          sizeof(iov) / sizeof(*iov), &hash,
                                          &hash_len, &error_fatal),
                      ==, 0);
-    g_assert_nonnull(hash);
-    g_assert_cmpuint(hash_len, ==, 32);
-    return hash;
 }
 
 static void apple_sep_sim_keystore_send_ipc_resp(AppleSEPSimState *s,
@@ -598,28 +643,25 @@ static void apple_sep_sim_keystore_send_ipc_resp(AppleSEPSimState *s,
                                                  const uint32_t resp_size)
 {
     KeystoreIPCHeader *resp_hdr;
-    uint8_t *resp_hash;
+    uint8_t resp_hash[32];
 
     resp_hdr = (KeystoreIPCHeader *)resp_buf;
-    resp_hash = apple_sep_sim_gen_sks_hash(resp_buf, resp_size);
+    apple_sep_sim_gen_sks_hash(resp_buf, resp_size, resp_hash);
 
     memcpy(resp_hdr->payload_hash, resp_hash, sizeof(resp_hdr->payload_hash));
-    g_free(resp_hash);
 
-    dma_memory_write(s->dma_as, s->ool_state[EP_KEYSTORE].out_addr, resp_buf,
-                     resp_size, MEMTXATTRS_UNSPECIFIED);
+    apple_sep_sim_post_write(s, s->ool_state[EP_KEYSTORE].out_addr, resp_buf,
+                             resp_size);
 
     apple_sep_sim_send_message(s, msg->ep, msg->tag | KEYSTORE_MSG_TAG_REPLY,
                                msg->id, 0, resp_size << 16);
 }
 
 static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
-                                              KeystoreMessage *msg)
+                                              KeystoreMessage *msg,
+                                              const uint8_t *msg_buf)
 {
     uint8_t msg_code = msg->tag & KEYSTORE_MSG_TAG_CODE_MASK;
-    uint8_t *msg_buf = g_new0(uint8_t, msg->size);
-    dma_memory_read(s->dma_as, s->ool_state[EP_KEYSTORE].in_addr, msg_buf,
-                    msg->size, MEMTXATTRS_UNSPECIFIED);
     const KeystoreIPCHeader *msg_hdr = (KeystoreIPCHeader *)msg_buf;
 #if 0
     char fn[128];
@@ -634,7 +676,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Create Keybag\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -652,7 +695,6 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *kb_id = 'BAG1';
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x02: {
@@ -664,7 +706,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
                       *lword, *word1);
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4 + 0x10;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -683,14 +726,14 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         memset(payload_blob + 1, 0xAF, *payload_blob);
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x03: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Load Keybag\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -708,14 +751,14 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *kb_handle = 'BAG1';
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x04: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Change Lock State\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4 + 0x8;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -736,14 +779,14 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         uint64_t *device_state = (uint64_t *)(lock_state + 1);
         *device_state = 0x1 | 0x2;
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x05: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Unload Keybag\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -759,7 +802,6 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *selector = 0;
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x08: {
@@ -791,7 +833,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Null D Key\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -808,14 +851,14 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *selector = 0;
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x0C: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Unwrap D Key\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -832,14 +875,14 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *selector = 0;
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x0D: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Make System Keybag\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -856,7 +899,6 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *selector = 0;
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x19: {
@@ -870,7 +912,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
             *lword, *word1, *word2);
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4 + 0x8;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -891,7 +934,6 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         memcpy(state_blob + 1, "applehax", *state_blob);
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     case 0x1B: {
@@ -900,7 +942,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
                       "SEP KeyStore // Client Terminate (0x%X)\n", *selector);
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_ool_out_buf(s, EP_KEYSTORE, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -916,85 +959,339 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *resp_selector = 0;
 
         apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
         break;
     }
     default: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Unknown (0x%02X)\n",
                       msg_code);
 
-        dma_memory_write(s->dma_as, s->ool_state[EP_KEYSTORE].out_addr, msg_buf,
-                         msg->size, MEMTXATTRS_UNSPECIFIED);
+        apple_sep_sim_post_write(s, s->ool_state[EP_KEYSTORE].out_addr, msg_buf,
+                                 msg->size);
         apple_sep_sim_send_message(s, msg->ep,
                                    msg->tag | KEYSTORE_MSG_TAG_REPLY, msg->id,
                                    0, (uint32_t)msg->size << 16);
         break;
     }
     }
-    g_free(msg_buf);
 }
 
-static void apple_sep_sim_bh(void *opaque)
+static void apple_sep_sim_handle_msg(AppleSEPSimState *s, SEPMessage *sep_msg,
+                                     const uint8_t *in)
+{
+    switch (sep_msg->ep) {
+    case EP_CONTROL:
+        apple_sep_sim_handle_control_msg(s, sep_msg);
+        break;
+    case EP_ART_STORAGE:
+        apple_sep_sim_handle_arts_msg(s, sep_msg);
+        break;
+    case EP_ART_REQUESTS:
+        qemu_log_mask(LOG_GUEST_ERROR, "EP_ART_REQUESTS: Unknown opcode %d\n",
+                      sep_msg->op);
+        break;
+    case EP_SECURE_CREDENTIALS:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "EP_SECURE_CREDENTIALS: Unknown opcode %d\n",
+                      sep_msg->op);
+        break;
+    case EP_XART_SLAVE:
+        apple_sep_sim_handle_xart_msg(s, true, sep_msg);
+        break;
+    case EP_KEYSTORE:
+        apple_sep_sim_handle_keystore_msg(s, (KeystoreMessage *)sep_msg, in);
+        break;
+    case EP_XART_MASTER:
+        apple_sep_sim_handle_xart_msg(s, false, sep_msg);
+        break;
+    case EP_DISCOVERY:
+        qemu_log_mask(LOG_GUEST_ERROR, "EP_DISCOVERY: Unknown opcode %d\n",
+                      sep_msg->op);
+        break;
+    case EP_L4INFO:
+        apple_sep_sim_handle_l4info(s, (L4InfoMessage *)sep_msg);
+        break;
+    case EP_BOOTSTRAP:
+        apple_sep_sim_handle_bootstrap_msg(s, sep_msg);
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "UNKNOWN_%d_OP_%d\n", sep_msg->ep,
+                      sep_msg->op);
+        break;
+    }
+}
+
+static void apple_sep_sim_record_latency(AppleSEPSimState *s, uint8_t ep,
+                                         int64_t queued_ns)
+{
+    int64_t us;
+    int bucket;
+
+    us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - queued_ns) / SCALE_US;
+    bucket = us <= 0 ? 0 : MIN(64 - clz64(us), SEP_SIM_LATENCY_BUCKETS - 1);
+    s->latency_hist[ep][bucket]++;
+}
+
+static void *apple_sep_sim_thread(void *opaque)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+    AppleSEPSimRequest *req;
+    SEPMessage *sep_msg;
+
+    rcu_register_thread();
+    for (;;) {
+        req = NULL;
+        WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+        {
+            while (QTAILQ_EMPTY(&s->queue) && !s->stopped) {
+                qemu_cond_wait(&s->thread_cond, &s->queue_mutex);
+            }
+            if (!s->stopped) {
+                req = QTAILQ_FIRST(&s->queue);
+                QTAILQ_REMOVE(&s->queue, req, entry);
+            }
+        }
+        if (req == NULL) {
+            break;
+        }
+
+        sep_msg = (SEPMessage *)req->data;
+        WITH_QEMU_LOCK_GUARD(&s->lock)
+        {
+            apple_sep_sim_handle_msg(s, sep_msg, req->in);
+            apple_sep_sim_record_latency(s, sep_msg->ep, req->queued_ns);
+        }
+        qemu_bh_schedule(s->reply_bh);
+
+        g_free(req->in);
+        g_free(req);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void apple_sep_sim_reply_bh(void *opaque)
 {
     AppleSEPSimState *s;
     AppleA7IOP *a7iop;
+    AppleSEPSimWrite *write;
     AppleA7IOPMessage *msg;
-    SEPMessage *sep_msg;
 
     s = APPLE_SEP_SIM(opaque);
     a7iop = APPLE_A7IOP(opaque);
 
-    QEMU_LOCK_GUARD(&s->lock);
-
-    while (!apple_a7iop_mailbox_is_empty(a7iop->iop_mailbox)) {
-        msg = apple_a7iop_recv_iop(a7iop);
-        sep_msg = (SEPMessage *)msg->data;
+    QEMU_LOCK_GUARD(&s->queue_mutex);
 
-        switch (sep_msg->ep) {
-        case EP_CONTROL:
-            apple_sep_sim_handle_control_msg(s, sep_msg);
-            break;
-        case EP_ART_STORAGE:
-            apple_sep_sim_handle_arts_msg(s, sep_msg);
-            break;
-        case EP_ART_REQUESTS:
-            qemu_log_mask(LOG_GUEST_ERROR,
-                          "EP_ART_REQUESTS: Unknown opcode %d\n", sep_msg->op);
-            break;
-        case EP_SECURE_CREDENTIALS:
+    while ((write = QTAILQ_FIRST(&s->writes)) != NULL) {
+        QTAILQ_REMOVE(&s->writes, write, entry);
+        if (dma_memory_write(s->dma_as, write->addr, write->data, write->size,
+                             MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
             qemu_log_mask(LOG_GUEST_ERROR,
-                          "EP_SECURE_CREDENTIALS: Unknown opcode %d\n",
-                          sep_msg->op);
-            break;
-        case EP_XART_SLAVE:
-            apple_sep_sim_handle_xart_msg(s, true, sep_msg);
-            break;
-        case EP_KEYSTORE:
-            apple_sep_sim_handle_keystore_msg(s, (KeystoreMessage *)sep_msg);
+                          "%s: Failed to write OOL at 0x%" PRIx64 "\n",
+                          __func__, write->addr);
+        }
+        g_free(write->data);
+        g_free(write);
+    }
+
+    // A full AP ring keeps the rest queued; the AP side draining the ring
+    // reschedules this BH.
+    while ((msg = QTAILQ_FIRST(&s->replies)) != NULL) {
+        QTAILQ_REMOVE(&s->replies, msg, entry);
+        if (!apple_a7iop_send_ap(a7iop, msg)) {
+            QTAILQ_INSERT_HEAD(&s->replies, msg, entry);
             break;
-        case EP_XART_MASTER:
-            apple_sep_sim_handle_xart_msg(s, false, sep_msg);
+        }
+    }
+}
+
+// OOL buffer addresses are applied in mailbox order as requests are queued,
+// so that the input copied below always uses the addresses the guest had
+// set up when it sent the request. The handlers only log and acknowledge.
+static void apple_sep_sim_update_ool(AppleSEPSimState *s, SEPMessage *sep_msg)
+{
+    SetOOLMessage *set_ool_msg;
+    L4InfoMessage *l4_msg;
+
+    set_ool_msg = (SetOOLMessage *)sep_msg;
+    switch (sep_msg->ep) {
+    case EP_CONTROL:
+        switch (sep_msg->op) {
+        case CONTROL_OP_SET_OOL_IN_ADDR:
+            apple_sep_sim_set_ool_in_addr(s, set_ool_msg->id,
+                                          (uint64_t)set_ool_msg->data << 12);
             break;
-        case EP_DISCOVERY:
-            qemu_log_mask(LOG_GUEST_ERROR, "EP_DISCOVERY: Unknown opcode %d\n",
-                          sep_msg->op);
+        case CONTROL_OP_SET_OOL_OUT_ADDR:
+            apple_sep_sim_set_ool_out_addr(s, set_ool_msg->id,
+                                           (uint64_t)set_ool_msg->data << 12);
             break;
-        case EP_L4INFO:
-            apple_sep_sim_handle_l4info(s, (L4InfoMessage *)sep_msg);
+        case CONTROL_OP_SET_OOL_IN_SIZE:
+            apple_sep_sim_set_ool_in_size(s, set_ool_msg->id,
+                                          set_ool_msg->data);
             break;
-        case EP_BOOTSTRAP:
-            apple_sep_sim_handle_bootstrap_msg(s, sep_msg);
+        case CONTROL_OP_SET_OOL_OUT_SIZE:
+            apple_sep_sim_set_ool_out_size(s, set_ool_msg->id,
+                                           set_ool_msg->data);
             break;
         default:
-            qemu_log_mask(LOG_GUEST_ERROR, "UNKNOWN_%d_OP_%d\n", sep_msg->ep,
-                          sep_msg->op);
             break;
         }
+        break;
+    case EP_L4INFO:
+        l4_msg = (L4InfoMessage *)sep_msg;
+        s->ool_state[EP_CONTROL].in_addr = (uint64_t)l4_msg->address << 12;
+        s->ool_state[EP_CONTROL].in_size = l4_msg->size << 12;
+        s->ool_state[EP_CONTROL].out_addr = (uint64_t)l4_msg->address << 12;
+        s->ool_state[EP_CONTROL].out_size = l4_msg->size << 12;
+        break;
+    default:
+        break;
+    }
+}
+
+static void apple_sep_sim_read_ool(AppleSEPSimState *s,
+                                   AppleSEPSimRequest *req)
+{
+    KeystoreMessage *ks_msg;
+    uint64_t addr;
+
+    if (((SEPMessage *)req->data)->ep != EP_KEYSTORE) {
+        return;
+    }
 
+    ks_msg = (KeystoreMessage *)req->data;
+    WITH_QEMU_LOCK_GUARD(&s->lock)
+    {
+        addr = s->ool_state[EP_KEYSTORE].in_addr;
+    }
+    // Never smaller than the IPC header the handler reads.
+    req->in_size = MAX(ks_msg->size, KEYSTORE_IPC_HEADER_SIZE);
+    req->in = g_malloc0(req->in_size);
+    dma_memory_read(s->dma_as, addr, req->in, ks_msg->size,
+                    MEMTXATTRS_UNSPECIFIED);
+}
+
+static void apple_sep_sim_bh(void *opaque)
+{
+    AppleSEPSimState *s;
+    AppleA7IOP *a7iop;
+    AppleSEPSimRequest *req;
+    AppleA7IOPMessage *msg;
+    int64_t now;
+
+    s = APPLE_SEP_SIM(opaque);
+    a7iop = APPLE_A7IOP(opaque);
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    while (!apple_a7iop_mailbox_is_empty(a7iop->iop_mailbox)) {
+        msg = apple_a7iop_recv_iop(a7iop);
+        req = g_new0(AppleSEPSimRequest, 1);
+        memcpy(req->data, msg->data, sizeof(req->data));
+        req->queued_ns = now;
         g_free(msg);
+        WITH_QEMU_LOCK_GUARD(&s->lock)
+        {
+            apple_sep_sim_update_ool(s, (SEPMessage *)req->data);
+        }
+        apple_sep_sim_read_ool(s, req);
+        WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+        {
+            QTAILQ_INSERT_TAIL(&s->queue, req, entry);
+        }
+    }
+    qemu_cond_signal(&s->thread_cond);
+}
+
+// The worker only runs while the VM does, so that no handler touches guest
+// memory or device state after the VM has been stopped for migration.
+static void apple_sep_sim_start(AppleSEPSimState *s)
+{
+    if (s->stopped) {
+        s->stopped = false;
+        qemu_thread_create(&s->thread, TYPE_APPLE_SEP_SIM,
+                           apple_sep_sim_thread, s, QEMU_THREAD_JOINABLE);
     }
 }
 
+// Waits for the request being handled, if any, and leaves the rest queued.
+// Handlers never wait for the BQL, so this is safe to call with it held.
+static void apple_sep_sim_stop(AppleSEPSimState *s)
+{
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        if (s->stopped) {
+            return;
+        }
+        s->stopped = true;
+        qemu_cond_signal(&s->thread_cond);
+    }
+    qemu_thread_join(&s->thread);
+}
+
+static void apple_sep_sim_flush(AppleSEPSimState *s)
+{
+    AppleSEPSimRequest *req;
+    AppleSEPSimWrite *write;
+    AppleA7IOPMessage *msg;
+
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        while ((req = QTAILQ_FIRST(&s->queue)) != NULL) {
+            QTAILQ_REMOVE(&s->queue, req, entry);
+            g_free(req->in);
+            g_free(req);
+        }
+        while ((write = QTAILQ_FIRST(&s->writes)) != NULL) {
+            QTAILQ_REMOVE(&s->writes, write, entry);
+            g_free(write->data);
+            g_free(write);
+        }
+        while ((msg = QTAILQ_FIRST(&s->replies)) != NULL) {
+            QTAILQ_REMOVE(&s->replies, msg, entry);
+            g_free(msg);
+        }
+    }
+}
+
+static void apple_sep_sim_vm_state_change(void *opaque, bool running,
+                                          RunState state)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+
+    if (running) {
+        apple_sep_sim_start(s);
+    } else {
+        apple_sep_sim_stop(s);
+    }
+}
+
+static char *apple_sep_sim_get_latency_hist(Object *obj, Error **errp)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(obj);
+    GString *str = g_string_new(NULL);
+    uint64_t hist[SEP_SIM_LATENCY_BUCKETS];
+    uint64_t total;
+
+    for (int ep = 0; ep <= UINT8_MAX; ep++) {
+        total = 0;
+        WITH_QEMU_LOCK_GUARD(&s->lock)
+        {
+            memcpy(hist, s->latency_hist[ep], sizeof(hist));
+        }
+        for (int i = 0; i < SEP_SIM_LATENCY_BUCKETS; i++) {
+            total += hist[i];
+        }
+        if (total == 0) {
+            continue;
+        }
+        g_string_append_printf(str, "ep %d:", ep);
+        for (int i = 0; i < SEP_SIM_LATENCY_BUCKETS; i++) {
+            g_string_append_printf(str, " %" PRIu64, hist[i]);
+        }
+        g_string_append_c(str, '\n');
+    }
+    return g_string_free(str, false);
+}
+
 AppleSEPSimState *apple_sep_sim_create(DTBNode *node, bool modern)
 {
     DeviceState *dev;
@@ -1017,6 +1314,20 @@ AppleSEPSimState *apple_sep_sim_create(DTBNode *node, bool modern)
                      qemu_bh_new(apple_sep_sim_bh, s));
 
     qemu_mutex_init(&s->lock);
+    qemu_mutex_init(&s->queue_mutex);
+    qemu_cond_init(&s->thread_cond);
+    QTAILQ_INIT(&s->queue);
+    QTAILQ_INIT(&s->writes);
+    QTAILQ_INIT(&s->replies);
+    s->reply_bh = qemu_bh_new(apple_sep_sim_reply_bh, s);
+    apple_a7iop_set_ap_drain_bh(a7iop, s->reply_bh);
+    s->stopped = true;
+    qemu_add_vm_change_state_handler(apple_sep_sim_vm_state_change, s);
+
+    // Per endpoint: request to reply latency in 2^n us buckets, bucket 0
+    // being under 1us.
+    object_property_add_str(OBJECT(s), "latency-histogram",
+                            apple_sep_sim_get_latency_hist, NULL);
 
     child = find_dtb_node(node, "iop-sep-nub");
     g_assert_nonnull(child);
@@ -1052,6 +1363,9 @@ static void apple_sep_sim_reset(DeviceState *dev)
         sc->parent_reset(dev);
     }
 
+    apple_sep_sim_stop(s);
+    apple_sep_sim_flush(s);
+
     QEMU_LOCK_GUARD(&s->lock);
 
     a7iop->iop_mailbox->ap_dir_en = true;
@@ -1099,9 +1413,103 @@ static void apple_sep_sim_reset(DeviceState *dev)
     sep_msg->ep = EP_BOOTSTRAP;
     sep_msg->op = BOOTSTRAP_OP_ANNOUNCE_STATUS;
     sep_msg->data = s->status;
-    apple_a7iop_send_ap(a7iop, msg);
+    apple_sep_sim_post_reply(s, msg);
+    apple_sep_sim_reply_bh(s);
+
+    if (runstate_is_running()) {
+        apple_sep_sim_start(s);
+    }
 }
 
+static int apple_sep_sim_request_post_load(void *opaque, int version_id)
+{
+    AppleSEPSimRequest *req = opaque;
+
+    req->queued_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    return 0;
+}
+
+static int apple_sep_sim_post_load(void *opaque, int version_id)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+
+    if (!QTAILQ_EMPTY(&s->writes) || !QTAILQ_EMPTY(&s->replies)) {
+        qemu_bh_schedule(s->reply_bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_apple_sep_sim_request = {
+    .name = "apple_sep_sim_request",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = apple_sep_sim_request_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT64_ARRAY(data, AppleSEPSimRequest, 2),
+            VMSTATE_UINT32(in_size, AppleSEPSimRequest),
+            VMSTATE_VBUFFER_ALLOC_UINT32(in, AppleSEPSimRequest, 0, NULL,
+                                         in_size),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static const VMStateDescription vmstate_apple_sep_sim_write = {
+    .name = "apple_sep_sim_write",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT64(addr, AppleSEPSimWrite),
+            VMSTATE_UINT32(size, AppleSEPSimWrite),
+            VMSTATE_VBUFFER_ALLOC_UINT32(data, AppleSEPSimWrite, 0, NULL,
+                                         size),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static const VMStateDescription vmstate_apple_sep_sim_ool_state = {
+    .name = "apple_sep_sim_ool_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT64(in_addr, AppleSEPSimOOLState),
+            VMSTATE_UINT32(in_size, AppleSEPSimOOLState),
+            VMSTATE_UINT64(out_addr, AppleSEPSimOOLState),
+            VMSTATE_UINT32(out_size, AppleSEPSimOOLState),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+// The worker is stopped with the VM, so the queues are stable when saved.
+static const VMStateDescription vmstate_apple_sep_sim = {
+    .name = "apple_sep_sim",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = apple_sep_sim_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_STRUCT(parent_obj, AppleSEPSimState, 0, vmstate_apple_a7iop,
+                           AppleA7IOP),
+            VMSTATE_BOOL(rsep, AppleSEPSimState),
+            VMSTATE_UINT32(status, AppleSEPSimState),
+            VMSTATE_STRUCT_ARRAY(ool_state, AppleSEPSimState, SEP_ENDPOINT_MAX,
+                                 1, vmstate_apple_sep_sim_ool_state,
+                                 AppleSEPSimOOLState),
+            VMSTATE_QTAILQ_V(queue, AppleSEPSimState, 0,
+                             vmstate_apple_sep_sim_request, AppleSEPSimRequest,
+                             entry),
+            VMSTATE_QTAILQ_V(writes, AppleSEPSimState, 0,
+                             vmstate_apple_sep_sim_write, AppleSEPSimWrite,
+                             entry),
+            VMSTATE_QTAILQ_V(replies, AppleSEPSimState, 0,
+                             vmstate_apple_a7iop_message, AppleA7IOPMessage,
+                             entry),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
 static void apple_sep_sim_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -1110,6 +1518,7 @@ static void apple_sep_sim_class_init(ObjectClass *klass, void *data)
                                     &sc->parent_realize);
     device_class_set_parent_reset(dc, apple_sep_sim_reset, &sc->parent_reset);
     dc->desc = "Simulated Apple Secure Enclave";
+    dc->vmsd = &vmstate_apple_sep_sim;
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
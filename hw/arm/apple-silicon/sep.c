@@ -25,7 +25,16 @@
 #include "hw/arm/apple-silicon/sep.h"
 #include "hw/core/cpu.h"
 #include "hw/misc/apple-silicon/a7iop/core.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "qapi/visitor.h"
 #include "qemu/log.h"
+#include "qemu/timer.h"
+#ifdef CONFIG_DARWIN
+#include <mach/mach_init.h>
+#include <mach/mach_port.h>
+#include <mach/thread_act.h>
+#endif
 
 #define REG_TRNG_FIFO_OUTPUT_BASE (0x00)
 #define REG_TRNG_FIFO_OUTPUT_END (0x0C)
@@ -70,6 +79,34 @@ static void trng_reg_write(void *opaque, hwaddr addr, uint64_t data,
     }
 }
 
+// SplitMix64, small enough that its whole state can be migrated.
+static uint64_t trng_prng_next(AppleTRNGState *s)
+{
+    uint64_t z = (s->prng_state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void trng_refill(AppleTRNGState *s)
+{
+    if (s->deterministic) {
+        for (uint32_t i = 0; i < TRNG_POOL_SIZE; i += sizeof(uint64_t)) {
+            stq_le_p(s->pool + i, trng_prng_next(s));
+        }
+    } else {
+        qcrypto_random_bytes(s->pool, TRNG_POOL_SIZE, NULL);
+    }
+    s->pool_pos = 0;
+}
+
+static void trng_reseed(AppleTRNGState *s)
+{
+    s->prng_state = s->seed;
+    s->pool_pos = TRNG_POOL_SIZE;
+}
+
 static uint64_t trng_reg_read(void *opaque, hwaddr addr, unsigned size)
 {
     AppleTRNGState *s;
@@ -78,11 +115,13 @@ static uint64_t trng_reg_read(void *opaque, hwaddr addr, unsigned size)
     s = (AppleTRNGState *)opaque;
 
     switch (addr) {
-    case REG_TRNG_FIFO_OUTPUT_BASE ... REG_TRNG_FIFO_OUTPUT_END: {
-        uint64_t ret = 0;
-        qcrypto_random_bytes(&ret, size, NULL);
+    case REG_TRNG_FIFO_OUTPUT_BASE ... REG_TRNG_FIFO_OUTPUT_END:
+        if (s->pool_pos + size > TRNG_POOL_SIZE) {
+            trng_refill(s);
+        }
+        ret = ldn_le_p(s->pool + s->pool_pos, size);
+        s->pool_pos += size;
         return ret;
-    }
     case REG_TRNG_STATUS:
         return TRNG_STATUS_FILLED;
     case REG_TRNG_CONFIG:
@@ -259,6 +298,53 @@ static const MemoryRegionOps misc2_reg_ops = {
 };
 
 
+// A message waiting in the inbox wakes the SEP from WFE even while its
+// mailbox interrupt is masked.
+static bool apple_sep_wfe_event(ARMCPU *cpu, void *opaque)
+{
+    AppleA7IOP *a7iop = opaque;
+
+    return !apple_a7iop_mailbox_is_empty(a7iop->iop_mailbox);
+}
+
+// Host CPU time consumed by the SEP vCPU thread (MTTCG only; in round-robin
+// mode all vCPUs share a thread and this reports the whole TCG thread).
+static void apple_sep_get_cpu_time_ns(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    AppleSEPState *s = APPLE_SEP(obj);
+    CPUState *cs = CPU(s->cpu);
+    uint64_t value = 0;
+
+    if (cs->thread != NULL) {
+#if defined(CONFIG_DARWIN)
+        mach_port_t thread = pthread_mach_thread_np(cs->thread->thread);
+        mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+        thread_basic_info_data_t info;
+
+        if (thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info,
+                        &count) == KERN_SUCCESS) {
+            value = (info.user_time.seconds + info.system_time.seconds) *
+                        NANOSECONDS_PER_SECOND +
+                    (info.user_time.microseconds +
+                     info.system_time.microseconds) *
+                        SCALE_US;
+        }
+#elif defined(CONFIG_LINUX)
+        clockid_t clock;
+        struct timespec ts;
+
+        if (pthread_getcpuclockid(cs->thread->thread, &clock) == 0 &&
+            clock_gettime(clock, &ts) == 0) {
+            value = ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+        }
+#endif
+    }
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 AppleSEPState *apple_sep_create(DTBNode *node, MemoryRegion *ool_mr, vaddr base,
                                 uint32_t cpu_id, uint32_t build_version,
                                 bool modern)
@@ -292,8 +378,19 @@ AppleSEPState *apple_sep_create(DTBNode *node, MemoryRegion *ool_mr, vaddr base,
         object_property_set_bool(OBJECT(s->cpu), "aarch64", false, NULL);
         unset_feature(&s->cpu->env, ARM_FEATURE_AARCH64);
     }
+    // The SEP spends most of its life in WFE waiting for the mailbox or its
+    // timer, so let it halt there instead of spinning its vCPU thread.
+    set_feature(&s->cpu->env, ARM_FEATURE_WFE_HALT);
+    arm_set_wfe_event_hook(s->cpu, apple_sep_wfe_event, a7iop);
     object_property_set_uint(OBJECT(s->cpu), "rvbar", s->base & ~0xFFF, NULL);
     object_property_add_child(OBJECT(dev), DEVICE(s->cpu)->id, OBJECT(s->cpu));
+    object_property_add_uint64_ptr(OBJECT(s), "wfe-timeout-ns",
+                                   &s->cpu->wfe_timeout_ns,
+                                   OBJ_PROP_FLAG_READWRITE);
+    object_property_add_uint64_ptr(OBJECT(s), "wfe-halts", &s->cpu->wfe_halts,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add(OBJECT(s), "cpu-time-ns", "uint64",
+                        apple_sep_get_cpu_time_ns, NULL, NULL, NULL);
 
     memory_region_init_io(&s->trng_mr, OBJECT(dev), &trng_reg_ops,
                           &s->trng_state, "sep.trng", 0x10000);
@@ -342,6 +439,7 @@ static void apple_sep_realize(DeviceState *dev, Error **errp)
         sc->parent_realize(dev, errp);
     }
     qdev_realize(DEVICE(s->cpu), NULL, errp);
+    trng_reseed(&s->trng_state);
     qdev_connect_gpio_out_named(dev, APPLE_A7IOP_IOP_IRQ, 0,
                                 qdev_get_gpio_in(DEVICE(s->cpu), ARM_CPU_IRQ));
 }
@@ -356,9 +454,75 @@ static void apple_sep_reset(DeviceState *dev)
     if (sc->parent_reset) {
         sc->parent_reset(dev);
     }
+    // Restart the stream so deterministic runs replay across resets too.
+    trng_reseed(&s->trng_state);
     run_on_cpu(CPU(s->cpu), apple_sep_cpu_reset_work, RUN_ON_CPU_HOST_PTR(s));
 }
 
+static bool apple_sep_trng_pool_needed(void *opaque)
+{
+    AppleSEPState *s = opaque;
+
+    return s->trng_state.deterministic ||
+           s->trng_state.pool_pos < TRNG_POOL_SIZE;
+}
+
+static int apple_sep_trng_pool_post_load(void *opaque, int version_id)
+{
+    AppleSEPState *s = opaque;
+
+    if (s->trng_state.pool_pos > TRNG_POOL_SIZE) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_apple_sep_trng_pool = {
+    .name = "apple_sep/trng_pool",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = apple_sep_trng_pool_needed,
+    .post_load = apple_sep_trng_pool_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT8_ARRAY(trng_state.pool, AppleSEPState,
+                                TRNG_POOL_SIZE),
+            VMSTATE_UINT32(trng_state.pool_pos, AppleSEPState),
+            VMSTATE_UINT64(trng_state.prng_state, AppleSEPState),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static const VMStateDescription vmstate_apple_sep = {
+    .name = "apple_sep",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_STRUCT(parent_obj, AppleSEPState, 0, vmstate_apple_a7iop,
+                           AppleA7IOP),
+            VMSTATE_UINT8_ARRAY(trng_state.key, AppleSEPState, 32),
+            VMSTATE_UINT64(trng_state.ecid, AppleSEPState),
+            VMSTATE_UINT32(trng_state.config, AppleSEPState),
+            VMSTATE_UINT8_ARRAY(misc0_regs, AppleSEPState, REG_SIZE),
+            VMSTATE_UINT8_ARRAY(misc1_regs, AppleSEPState, REG_SIZE),
+            VMSTATE_UINT8_ARRAY(misc2_regs, AppleSEPState, REG_SIZE),
+            VMSTATE_END_OF_LIST(),
+        },
+    .subsections =
+        (const VMStateDescription *const[]){
+            &vmstate_apple_sep_trng_pool,
+            NULL,
+        },
+};
+
+static Property apple_sep_properties[] = {
+    DEFINE_PROP_BOOL("trng-deterministic", AppleSEPState,
+                     trng_state.deterministic, false),
+    DEFINE_PROP_UINT64("trng-seed", AppleSEPState, trng_state.seed, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_sep_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -366,6 +530,8 @@ static void apple_sep_class_init(ObjectClass *klass, void *data)
     device_class_set_parent_realize(dc, apple_sep_realize, &sc->parent_realize);
     device_class_set_parent_reset(dc, apple_sep_reset, &sc->parent_reset);
     dc->desc = "Apple SEP";
+    dc->vmsd = &vmstate_apple_sep;
+    device_class_set_props(dc, apple_sep_properties);
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
@@ -49,6 +49,7 @@
 #include "hw/ssi/ssi.h"
 #include "hw/usb/apple_typec.h"
 #include "hw/watchdog/apple_wdt.h"
+#include "migration/vmstate.h"
 #include "qapi/visitor.h"
 #include "qemu/error-report.h"
 #include "qemu/guest-random.h"
@@ -302,17 +303,20 @@ static void t8030_load_classic_kc(T8030MachineState *t8030_machine,
     // RAM disk
     if (machine->initrd_filename) {
         info->ramdisk_addr = phys_ptr;
-        macho_load_ramdisk(machine->initrd_filename, nsas, sysmem,
-                           info->ramdisk_addr, &info->ramdisk_size);
+        macho_load_ramdisk(machine->initrd_filename,
+                           t8030_machine->payload_cache, nsas, sysmem,
+                           info->ramdisk_addr, &t8030_machine->ramdisk_mr,
+                           &info->ramdisk_size);
         info->ramdisk_size = align_16k_high(info->ramdisk_size);
         phys_ptr += info->ramdisk_size;
     }
 
     // SEPFW
     info->sep_fw_addr = phys_ptr;
-    if (t8030_machine->sep_fw_filename) {
-        macho_load_raw_file(t8030_machine->sep_fw_filename, nsas, sysmem,
-                            "sepfw", info->sep_fw_addr, &info->sep_fw_size);
+    if (t8030_machine->sep_fw) {
+        address_space_write(nsas, info->sep_fw_addr, MEMTXATTRS_UNSPECIFIED,
+                            g_bytes_get_data(t8030_machine->sep_fw, NULL),
+                            g_bytes_get_size(t8030_machine->sep_fw));
     }
     info->sep_fw_size = align_16k_high(8 * MiB);
     phys_ptr += info->sep_fw_size;
@@ -428,8 +432,10 @@ static void t8030_load_fileset_kc(T8030MachineState *t8030_machine,
 
     if (machine->initrd_filename) {
         info->ramdisk_addr = phys_ptr;
-        macho_load_ramdisk(machine->initrd_filename, nsas, sysmem,
-                           info->ramdisk_addr, &info->ramdisk_size);
+        macho_load_ramdisk(machine->initrd_filename,
+                           t8030_machine->payload_cache, nsas, sysmem,
+                           info->ramdisk_addr, &t8030_machine->ramdisk_mr,
+                           &info->ramdisk_size);
         info->ramdisk_size = align_16k_high(info->ramdisk_size);
         phys_ptr += info->ramdisk_size;
     }
@@ -460,6 +466,20 @@ static void t8030_load_fileset_kc(T8030MachineState *t8030_machine,
     g_virt_base = virt_low;
 }
 
+static GBytes *t8030_load_boot_file(const char *filename)
+{
+    char *data = NULL;
+    gsize size = 0;
+
+    if (!g_file_get_contents(filename, &data, &size, NULL)) {
+        error_setg(&error_fatal, "Could not load data from file '%s'",
+                   filename);
+        return NULL;
+    }
+
+    return g_bytes_new_take(data, size);
+}
+
 static void t8030_memory_setup(MachineState *machine)
 {
     MachoHeader64 *hdr;
@@ -470,28 +490,25 @@ static void t8030_memory_setup(MachineState *machine)
         get_dtb_node(t8030_machine->device_tree, "/chosen/memory-map");
     AddressSpace *nsas = &address_space_memory;
     char *cmdline = NULL;
-    char *seprom = NULL;
-    unsigned long fsize = 0;
+    int64_t start;
+    int64_t seprom_done;
+    int64_t nvram_done;
+    int64_t dtb_done;
 
     if (t8030_check_panic(machine)) {
         qemu_system_guest_panicked(NULL);
         return;
     }
 
+    start = g_get_monotonic_time();
+
     info->dram_base = T8030_DRAM_BASE;
     info->dram_size = T8030_DRAM_SIZE;
 
-    if (t8030_machine->seprom_filename) {
-        if (!g_file_get_contents(t8030_machine->seprom_filename, &seprom,
-                                 &fsize, NULL)) {
-            error_setg(&error_fatal, "Could not load data from file '%s'",
-                       t8030_machine->seprom_filename);
-            return;
-        }
-        address_space_rw(nsas, T8030_SEPROM_BASE, MEMTXATTRS_UNSPECIFIED,
-                         (uint8_t *)seprom, fsize, true);
-
-        g_free(seprom);
+    if (t8030_machine->seprom) {
+        address_space_write(nsas, T8030_SEPROM_BASE, MEMTXATTRS_UNSPECIFIED,
+                            g_bytes_get_data(t8030_machine->seprom, NULL),
+                            g_bytes_get_size(t8030_machine->seprom));
 
         uint64_t value = 0x8000000000000000;
         address_space_write(nsas, t8030_machine->soc_base_pa + 0x42140108,
@@ -500,6 +517,7 @@ static void t8030_memory_setup(MachineState *machine)
         address_space_write(nsas, t8030_machine->soc_base_pa + 0x41448000,
                             MEMTXATTRS_UNSPECIFIED, &value32, sizeof(value32));
     }
+    seprom_done = g_get_monotonic_time();
 
     nvram = APPLE_NVRAM(qdev_find_recursive(sysbus_get_default(), "nvram"));
     if (!nvram) {
@@ -548,15 +566,7 @@ static void t8030_memory_setup(MachineState *machine)
                               sizeof(info->nvram_data)) < 0) {
         error_report("%s: Failed to read NVRAM", __func__);
     }
-
-    if (t8030_machine->ticket_filename) {
-        if (!g_file_get_contents(t8030_machine->ticket_filename,
-                                 &info->ticket_data,
-                                 (gsize *)&info->ticket_length, NULL)) {
-            error_report("%s: Failed to read ticket from file %s", __func__,
-                         t8030_machine->ticket_filename);
-        }
-    }
+    nvram_done = g_get_monotonic_time();
 
     if (xnu_contains_boot_arg(cmdline, "-restore", false)) {
         // HACK: Use DEV model to restore without FDR errors
@@ -611,6 +621,7 @@ static void t8030_memory_setup(MachineState *machine)
     macho_allocate_segment_records(memory_map, hdr);
 
     macho_populate_dtb(t8030_machine->device_tree, info);
+    dtb_done = g_get_monotonic_time();
 
     switch (hdr->file_type) {
     case MH_EXECUTE:
@@ -625,6 +636,13 @@ static void t8030_memory_setup(MachineState *machine)
         break;
     }
 
+    info_report("Boot image prepared in %" PRId64 " us (SEPROM: %" PRId64
+                " us, NVRAM: %" PRId64 " us, device tree: %" PRId64
+                " us, kernelcache: %" PRId64 " us)",
+                g_get_monotonic_time() - start, seprom_done - start,
+                nvram_done - seprom_done, dtb_done - nvram_done,
+                g_get_monotonic_time() - dtb_done);
+
     g_free(cmdline);
 }
 
@@ -1858,6 +1876,12 @@ static void t8030_create_sep(MachineState *machine)
         T8030_SEPROM_BASE, A13_MAX_CPU + 1, t8030_machine->build_version, true);
     g_assert_nonnull(sep);
 
+    if (t8030_machine->trng_seed_set) {
+        qdev_prop_set_bit(DEVICE(sep), "trng-deterministic", true);
+        qdev_prop_set_uint64(DEVICE(sep), "trng-seed",
+                             t8030_machine->trng_seed);
+    }
+
     object_property_add_child(OBJECT(machine), "sep", OBJECT(sep));
 
     prop = find_dtb_prop(child, "reg");
@@ -2016,6 +2040,22 @@ static void t8030_machine_init_done(Notifier *notifier, void *data)
     t8030_cpu_reset(t8030_machine);
 }
 
+static const VMStateDescription vmstate_t8030_machine = {
+    .name = "t8030_machine",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT8_ARRAY(pmgr_reg, T8030MachineState, 0x100000),
+            VMSTATE_UINT8_ARRAY(amcc_reg, T8030MachineState, 0x100000),
+            VMSTATE_UINT64(bootinfo.kern_entry, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.kern_boot_args_addr, T8030MachineState),
+            VMSTATE_UINT64(panic_base, T8030MachineState),
+            VMSTATE_UINT64(panic_size, T8030MachineState),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
 static void t8030_machine_init(MachineState *machine)
 {
     T8030MachineState *t8030_machine;
@@ -2052,7 +2092,8 @@ static void t8030_machine_init(MachineState *machine)
     allocate_ram(t8030_machine->sysmem, "DRAM_3", 0x300000000ULL,
                  0x100000000ULL, 0);
 
-    hdr = macho_load_file(machine->kernel_filename, NULL);
+    hdr = macho_load_file(machine->kernel_filename,
+                          t8030_machine->payload_cache, NULL);
     g_assert_nonnull(hdr);
     t8030_machine->kernel = hdr;
     build_version = macho_build_version(hdr);
@@ -2090,10 +2131,33 @@ static void t8030_machine_init(MachineState *machine)
 
     t8030_patch_kernel(hdr);
 
-    t8030_machine->device_tree = load_dtb_from_file(machine->dtb);
+    t8030_machine->device_tree =
+        load_dtb_from_file(machine->dtb, t8030_machine->payload_cache);
     t8030_machine->trustcache =
         load_trustcache_from_file(t8030_machine->trustcache_filename,
+                                  t8030_machine->payload_cache,
                                   &t8030_machine->bootinfo.trustcache_size);
+
+    // These do not change between boots, so read them only once instead of
+    // on every guest reboot.
+    if (t8030_machine->seprom_filename) {
+        t8030_machine->seprom =
+            t8030_load_boot_file(t8030_machine->seprom_filename);
+    }
+    if (t8030_machine->sep_fw_filename) {
+        t8030_machine->sep_fw =
+            t8030_load_boot_file(t8030_machine->sep_fw_filename);
+    }
+    if (t8030_machine->ticket_filename) {
+        AppleBootInfo *info = &t8030_machine->bootinfo;
+
+        if (!g_file_get_contents(t8030_machine->ticket_filename,
+                                 &info->ticket_data,
+                                 (gsize *)&info->ticket_length, NULL)) {
+            error_report("%s: Failed to read ticket from file %s", __func__,
+                         t8030_machine->ticket_filename);
+        }
+    }
     data = 24000000;
     set_dtb_prop(t8030_machine->device_tree, "clock-frequency", sizeof(data),
                  &data);
@@ -2228,6 +2292,8 @@ static void t8030_machine_init(MachineState *machine)
 
     t8030_display_create(machine);
 
+    vmstate_register(NULL, 0, &vmstate_t8030_machine, t8030_machine);
+
     t8030_machine->init_done_notifier.notify = t8030_machine_init_done;
     qemu_add_machine_init_done_notifier(&t8030_machine->init_done_notifier);
 }
@@ -2250,6 +2316,24 @@ static char *t8030_get_trustcache_filename(Object *obj, Error **errp)
     return g_strdup(t8030_machine->trustcache_filename);
 }
 
+static void t8030_set_payload_cache(Object *obj, const char *value,
+                                    Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->payload_cache);
+    t8030_machine->payload_cache = g_strdup(value);
+}
+
+static char *t8030_get_payload_cache(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->payload_cache);
+}
+
 static void t8030_set_ticket_filename(Object *obj, const char *value,
                                       Error **errp)
 {
@@ -2384,6 +2468,33 @@ static bool t8030_get_kaslr_off(Object *obj, Error **errp)
     return t8030_machine->kaslr_off;
 }
 
+static void t8030_get_trng_seed(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    uint64_t value;
+
+    t8030_machine = T8030_MACHINE(obj);
+    value = t8030_machine->trng_seed;
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void t8030_set_trng_seed(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    uint64_t value;
+
+    t8030_machine = T8030_MACHINE(obj);
+
+    if (!visit_type_uint64(v, name, &value, errp)) {
+        return;
+    }
+
+    t8030_machine->trng_seed = value;
+    t8030_machine->trng_seed_set = true;
+}
+
 static ram_addr_t t8030_machine_fixup_ram_size(ram_addr_t size)
 {
     g_assert_cmpuint(size, ==, T8030_DRAM_SIZE);
@@ -2428,6 +2539,12 @@ static void t8030_machine_class_init(ObjectClass *klass, void *data)
                                   t8030_set_trustcache_filename);
     object_class_property_set_description(klass, "trustcache",
                                           "Trustcache to be loaded");
+    object_class_property_add_str(klass, "payload-cache",
+                                  t8030_get_payload_cache,
+                                  t8030_set_payload_cache);
+    object_class_property_set_description(
+        klass, "payload-cache",
+        "Directory to cache decoded kernelcache and IMG4 payloads in");
     object_class_property_add_str(klass, "ticket", t8030_get_ticket_filename,
                                   t8030_set_ticket_filename);
     object_class_property_set_description(klass, "ticket",
@@ -2452,6 +2569,11 @@ static void t8030_machine_class_init(ObjectClass *klass, void *data)
     object_class_property_add_bool(klass, "force-dfu", t8030_get_force_dfu,
                                    t8030_set_force_dfu);
     object_class_property_set_description(klass, "force-dfu", "Force DFU");
+    object_class_property_add(klass, "trng-seed", "uint64", t8030_get_trng_seed,
+                              t8030_set_trng_seed, NULL, NULL);
+    object_class_property_set_description(
+        klass, "trng-seed",
+        "Seed the SEP TRNG for a reproducible stream instead of host entropy");
 }
 
 static const TypeInfo t8030_machine_info = {
@@ -252,6 +252,7 @@ SysBusDevice *apple_ans_create(DTBNode *node, AppleA7IOPVersion version,
                              &error_fatal);
     object_property_set_uint(OBJECT(&s->nvme), "physical_block_size", 4096,
                              &error_fatal);
+    /* Doorbells are deferred to the main loop through the queue BHs. */
 
     pcie_host_mmcfg_init(pex, PCIE_MMCFG_SIZE_MAX);
     memory_region_init(&s->io_mmio, OBJECT(s), "ans_pci_mmio", UINT64_MAX);
@@ -28,8 +28,6 @@
 #include "qom/object.h"
 #include "sysemu/dma.h"
 #include "ui/console.h"
-#include "ui/pixel_ops.h"
-#include "framebuffer.h"
 
 // #define DEBUG_DISP
 
@@ -152,6 +150,29 @@ static void apple_disp_gp_reg_write(GenPipeState *s, hwaddr addr, uint64_t data)
                     data);
         break;
     }
+    case REG_GP_LAYER_1_START: {
+        DISP_DBGLOG("[GP%zu] Layer 1 start <- 0x" HWADDR_FMT_plx, s->index,
+                    data);
+        s->layers[1].start = (uint32_t)data;
+        break;
+    }
+    case REG_GP_LAYER_1_END: {
+        DISP_DBGLOG("[GP%zu] Layer 1 end <- 0x" HWADDR_FMT_plx, s->index, data);
+        s->layers[1].end = (uint32_t)data;
+        break;
+    }
+    case REG_GP_LAYER_1_STRIDE: {
+        s->layers[1].stride = (uint32_t)data;
+        DISP_DBGLOG("[GP%zu] Layer 1 stride <- 0x" HWADDR_FMT_plx, s->index,
+                    data);
+        break;
+    }
+    case REG_GP_LAYER_1_SIZE: {
+        s->layers[1].size = (uint32_t)data;
+        DISP_DBGLOG("[GP%zu] Layer 1 size <- 0x" HWADDR_FMT_plx, s->index,
+                    data);
+        break;
+    }
     case REG_GP_FRAME_SIZE: {
         DISP_DBGLOG("[GP%zu] Frame size <- 0x" HWADDR_FMT_plx, s->index, data);
         s->height = data & 0xFFFF;
@@ -197,6 +218,29 @@ static uint32_t apple_disp_gp_reg_read(GenPipeState *s, hwaddr addr)
                     s->layers[0].size);
         return s->layers[0].size;
     }
+    case REG_GP_LAYER_1_START: {
+        DISP_DBGLOG("[GP%zu] Layer 1 start -> 0x%x", s->index,
+                    s->layers[1].start);
+        return s->layers[1].start;
+    }
+    case REG_GP_LAYER_1_END: {
+        DISP_DBGLOG("[GP%zu] Layer 1 end -> 0x%x", s->index, s->layers[1].end);
+        return s->layers[1].end;
+    }
+    case REG_GP_LAYER_1_STRIDE: {
+        DISP_DBGLOG("[GP%zu] Layer 1 stride -> 0x%x", s->index,
+                    s->layers[1].stride);
+        return s->layers[1].stride;
+    }
+    case REG_GP_LAYER_1_SIZE: {
+        DISP_DBGLOG("[GP%zu] Layer 1 size -> 0x%x", s->index,
+                    s->layers[1].size);
+        return s->layers[1].size;
+    }
+    case REG_GP_STATUS: {
+        DISP_DBGLOG("[GP%zu] Status -> 0x%x", s->index, s->status);
+        return s->status;
+    }
     case REG_GP_FRAME_SIZE: {
         DISP_DBGLOG("[GP%zu] Frame size -> 0x%x (width: %d height: %d)",
                     s->index, (s->width << 16) | s->height, s->width,
@@ -210,75 +254,293 @@ static uint32_t apple_disp_gp_reg_read(GenPipeState *s, hwaddr addr)
     }
 }
 
-static uint8_t *apple_disp_gp_read_layer(GenPipeState *s, size_t i,
-                                         AddressSpace *dma_as, size_t *size_out)
+typedef struct {
+    pixman_image_t *image;
+    void *map;
+    dma_addr_t map_len;
+} GenPipeLayerImage;
+
+static pixman_format_code_t apple_disp_gp_format(GenPipeState *s)
 {
-    size_t size;
-    uint8_t *buf;
+    if ((s->pixel_format & GP_PIXEL_FORMAT_BGRA_MASK) ==
+        GP_PIXEL_FORMAT_ARGB) {
+        DISP_DBGLOG("[GP%zu] Pixel Format is ARGB (0x%X).", s->index,
+                    s->pixel_format);
+        return PIXMAN_BE_a8r8g8b8;
+    }
+    if ((s->pixel_format & GP_PIXEL_FORMAT_BGRA_MASK) !=
+        GP_PIXEL_FORMAT_BGRA) {
+        DISP_DBGLOG("[GP%zu] Pixel Format is unknown (0x%X).", s->index,
+                    s->pixel_format);
+    } else {
+        DISP_DBGLOG("[GP%zu] Pixel Format is BGRA (0x%X).", s->index,
+                    s->pixel_format);
+    }
+    return PIXMAN_LE_a8r8g8b8;
+}
+
+static bool apple_disp_gp_layer_enabled(GenPipeState *s, size_t i)
+{
+    return s->layers[i].start && s->layers[i].end > s->layers[i].start;
+}
+
+static bool apple_disp_gp_copy_changed(uint8_t *dest, const void *src,
+                                       size_t len)
+{
+    if (memcmp(dest, src, len) == 0) {
+        return false;
+    }
+    memcpy(dest, src, len);
+    return true;
+}
+
+static bool apple_disp_gp_copy_row(GenPipeState *s, dma_addr_t addr,
+                                   uint8_t *dest, dma_addr_t len, bool *changed)
+{
+    dma_addr_t plen;
+    void *src;
+
+    while (len) {
+        plen = len;
+        src = dma_memory_map(s->dma_as, addr, &plen, DMA_DIRECTION_TO_DEVICE,
+                             MEMTXATTRS_UNSPECIFIED);
+        if (src == NULL) {
+            return false;
+        }
+        if (apple_disp_gp_copy_changed(dest, src, plen)) {
+            *changed = true;
+        }
+        dma_memory_unmap(s->dma_as, src, plen, DMA_DIRECTION_TO_DEVICE, plen);
+        addr += plen;
+        dest += plen;
+        len -= plen;
+    }
 
-    *size_out = 0;
+    return true;
+}
 
-    if (!s->layers[i].start || !s->layers[i].end) {
-        return NULL;
+static bool apple_disp_gp_map_layer(GenPipeState *s, size_t i,
+                                    pixman_format_code_t format,
+                                    GenPipeLayerImage *img)
+{
+    GenPipeLayer *layer = &s->layers[i];
+    uint16_t height = layer->size & 0xFFFF;
+    uint16_t width = (layer->size >> 16) & 0xFFFF;
+    uint32_t stride = layer->stride;
+    dma_addr_t len = layer->end - layer->start;
+    uint8_t *bits;
+
+    memset(img, 0, sizeof(*img));
+
+    if (!width || !height) {
+        return false;
+    }
+
+    if (stride % sizeof(uint32_t) != 0 ||
+        (uint64_t)(height - 1) * stride + width * sizeof(uint32_t) > len) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "[GP%zu] Layer %zu of %dx%d with stride %d does not "
+                      "fit in 0x%" PRIx64 " bytes.\n",
+                      s->index, i, width, height, stride, len);
+        return false;
+    }
+
+    // Use the guest pages as they are when the layer is backed by a single
+    // contiguous chunk of host memory, and stage it otherwise.
+    if (QEMU_IS_ALIGNED(layer->start, sizeof(uint32_t))) {
+        img->map_len = len;
+        img->map = dma_memory_map(s->dma_as, layer->start, &img->map_len,
+                                  DMA_DIRECTION_TO_DEVICE,
+                                  MEMTXATTRS_UNSPECIFIED);
+        if (img->map != NULL && img->map_len != len) {
+            dma_memory_unmap(s->dma_as, img->map, img->map_len,
+                             DMA_DIRECTION_TO_DEVICE, 0);
+            img->map = NULL;
+        }
     }
 
-    size = s->layers[i].end - s->layers[i].start;
-    buf = g_malloc(size);
+    if (img->map != NULL) {
+        bits = img->map;
+    } else {
+        if (layer->buf_size < len) {
+            g_free(layer->buf);
+            layer->buf = g_malloc(len);
+            layer->buf_size = len;
+        }
+        if (dma_memory_read(s->dma_as, layer->start, layer->buf, len,
+                            MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "[GP%zu] Failed to read layer %zu.\n", s->index, i);
+            return false;
+        }
+        bits = layer->buf;
+    }
 
-    if (dma_memory_read(dma_as, s->layers[i].start, buf, size,
-                        MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
-        g_free(buf);
-        return NULL;
+    img->image = pixman_image_create_bits(format, width, height,
+                                          (uint32_t *)bits, stride);
+    if (img->image == NULL) {
+        if (img->map != NULL) {
+            dma_memory_unmap(s->dma_as, img->map, img->map_len,
+                             DMA_DIRECTION_TO_DEVICE, 0);
+            img->map = NULL;
+        }
+        return false;
     }
 
-    *size_out = size;
-    return buf;
+    return true;
+}
+
+static void apple_disp_gp_unmap_layer(GenPipeState *s, GenPipeLayerImage *img)
+{
+    if (img->image != NULL) {
+        pixman_image_unref(img->image);
+    }
+    if (img->map != NULL) {
+        dma_memory_unmap(s->dma_as, img->map, img->map_len,
+                         DMA_DIRECTION_TO_DEVICE, img->map_len);
+    }
+}
+
+// Premultiplied alpha, which is what pixman works with natively: layer 0
+// is the opaque base and layer 1 is blended on top of it.
+static bool apple_disp_gp_composite(GenPipeState *s,
+                                    pixman_format_code_t format)
+{
+    GenPipeLayerImage layers[2];
+    pixman_image_t *dest;
+    uint16_t width = s->disp_state->width;
+    uint16_t height = s->disp_state->height;
+    size_t pitch = width * sizeof(uint32_t);
+
+    if (!apple_disp_gp_map_layer(s, 0, format, &layers[0])) {
+        return false;
+    }
+    if (!apple_disp_gp_layer_enabled(s, 1) ||
+        !apple_disp_gp_map_layer(s, 1, format, &layers[1])) {
+        memset(&layers[1], 0, sizeof(layers[1]));
+    }
+
+    if (s->composite == NULL) {
+        s->composite = g_malloc0(pitch * height);
+    }
+    dest = pixman_image_create_bits(PIXMAN_LE_x8r8g8b8, width, height,
+                                    (uint32_t *)s->composite, pitch);
+
+    if (pixman_image_get_width(layers[0].image) < width ||
+        pixman_image_get_height(layers[0].image) < height) {
+        memset(s->composite, 0, pitch * height);
+    }
+    pixman_image_composite(PIXMAN_OP_SRC, layers[0].image, NULL, dest, 0, 0, 0,
+                           0, 0, 0, pixman_image_get_width(layers[0].image),
+                           pixman_image_get_height(layers[0].image));
+    if (layers[1].image != NULL) {
+        pixman_image_composite(PIXMAN_OP_OVER, layers[1].image, NULL, dest, 0,
+                               0, 0, 0, 0, 0,
+                               pixman_image_get_width(layers[1].image),
+                               pixman_image_get_height(layers[1].image));
+    }
+
+    pixman_image_unref(dest);
+    apple_disp_gp_unmap_layer(s, &layers[1]);
+    apple_disp_gp_unmap_layer(s, &layers[0]);
+    return true;
+}
+
+static bool apple_disp_gp_draw(GenPipeState *s)
+{
+    pixman_format_code_t format;
+    uint8_t *dest;
+    size_t pitch;
+    uint16_t width, height;
+    uint32_t stride;
+    int dirty_start;
+    bool composited, changed;
+
+    DISP_DBGLOG("[GP%zu] Layer 0 width and height is %dx%d.", s->index,
+                (s->layers[0].size >> 16) & 0xFFFF, s->layers[0].size & 0xFFFF);
+    DISP_DBGLOG("[GP%zu] Layer 0 stride is %d.", s->index, s->layers[0].stride);
+    format = apple_disp_gp_format(s);
+
+    // A lone layer in the scanout format can be copied straight out of guest
+    // RAM, anything else goes through the compositor first.
+    composited = format != PIXMAN_LE_a8r8g8b8 ||
+                 apple_disp_gp_layer_enabled(s, 1);
+    if (composited) {
+        if (!apple_disp_gp_composite(s, format)) {
+            return false;
+        }
+        width = s->disp_state->width;
+        height = s->disp_state->height;
+        stride = width * sizeof(uint32_t);
+    } else {
+        width = MIN((s->layers[0].size >> 16) & 0xFFFF, s->disp_state->width);
+        height = MIN(s->layers[0].size & 0xFFFF, s->disp_state->height);
+        stride = s->layers[0].stride;
+    }
+
+    pitch = s->disp_state->width * sizeof(uint32_t);
+    dest = memory_region_get_ram_ptr(s->vram);
+    dirty_start = -1;
+
+    // Only touch the rows that differ from what is already being scanned out,
+    // so that the console only gets to redraw what actually changed.
+    for (int y = 0; y < height; y++) {
+        changed = false;
+        if (composited) {
+            changed = apple_disp_gp_copy_changed(dest + y * pitch,
+                                                 s->composite + y * stride,
+                                                 width * sizeof(uint32_t));
+        } else if (!apple_disp_gp_copy_row(s, s->layers[0].start + y * stride,
+                                           dest + y * pitch,
+                                           width * sizeof(uint32_t),
+                                           &changed)) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "[GP%zu] Failed to map layer 0 row %d.\n", s->index,
+                          y);
+            height = y;
+            break;
+        }
+        if (changed && dirty_start < 0) {
+            dirty_start = y;
+        } else if (!changed && dirty_start >= 0) {
+            memory_region_set_dirty(s->vram, dirty_start * pitch,
+                                    (y - dirty_start) * pitch);
+            dirty_start = -1;
+        }
+    }
+    if (dirty_start >= 0) {
+        memory_region_set_dirty(s->vram, dirty_start * pitch,
+                                (height - dirty_start) * pitch);
+    }
+    return true;
 }
 
 static void apple_gp_draw_bh(void *opaque)
 {
     GenPipeState *s;
-    size_t size;
-    uint8_t *buf;
 
     s = (GenPipeState *)opaque;
-    size = 0;
-    buf = apple_disp_gp_read_layer(s, 0, s->dma_as, &size);
 
-    if (buf == NULL) {
+    if (!apple_disp_gp_layer_enabled(s, 0)) {
         return;
     }
 
-    // TODO: Blend both layers. 2nd layer is currently not used.
-    uint16_t height = s->layers[0].size & 0xFFFF;
-    uint16_t width = (s->layers[0].size >> 16) & 0xFFFF;
-    DISP_DBGLOG("[GP%zu] Layer 0 width and height is %dx%d.", s->index, width,
-                height);
-    DISP_DBGLOG("[GP%zu] Layer 0 stride is %d.", s->index, s->layers[0].stride);
-    if ((s->pixel_format & GP_PIXEL_FORMAT_BGRA_MASK) ==
-        GP_PIXEL_FORMAT_BGRA_MASK) {
-        DISP_DBGLOG("[GP%zu] Pixel Format is BGRA (0x%X).", s->index,
-                    s->pixel_format);
-    } else if ((s->pixel_format & GP_PIXEL_FORMAT_ARGB) ==
-               GP_PIXEL_FORMAT_ARGB) {
-        DISP_DBGLOG("[GP%zu] Pixel Format is ARGB (0x%X).", s->index,
-                    s->pixel_format);
+    // TODO: Decompress the data and display it properly. The compressed
+    // layout is not known, so keep the last frame on screen rather than
+    // scanning out the payload as raw pixels, and flag the failure.
+    if (s->pixel_format & GP_PIXEL_FORMAT_COMPRESSED) {
+        if (!(s->status & GP_STATUS_DECOMPRESSION_FAIL)) {
+            qemu_log_mask(LOG_UNIMP,
+                          "[GP%zu] Compressed layers are not supported.\n",
+                          s->index);
+        }
+        s->status |= GP_STATUS_DECOMPRESSION_FAIL;
+    } else if (!apple_disp_gp_draw(s)) {
+        return;
     } else {
-        DISP_DBGLOG("[GP%zu] Pixel Format is unknown (0x%X).", s->index,
-                    s->pixel_format);
+        s->status &= ~GP_STATUS_DECOMPRESSION_FAIL;
     }
-    // TODO: Decompress the data and display it properly.
-    uint16_t stride = s->pixel_format & GP_PIXEL_FORMAT_COMPRESSED ?
-                          width :
-                          s->layers[0].stride;
-    for (uint16_t y = 0; y < height; y++) {
-        uint8_t *dest = memory_region_get_ram_ptr(s->vram);
-        memcpy(dest + (y * (s->disp_state->width * sizeof(uint32_t))),
-               buf + (y * stride), width * sizeof(uint32_t));
-    }
-    memory_region_set_dirty(s->vram, 0,
-                            s->height * s->width * sizeof(uint32_t));
-    g_free(buf);
+
     // TODO: bit 10 might be VBlank, and bit 20 that the transfer finished.
     s->disp_state->int_filter |= BIT(10) | BIT(20);
     // TODO: irq 0 might be VBlank, 2 be GP0, 3 be GP1.
@@ -289,6 +551,12 @@ static bool apple_genpipev2_init(GenPipeState *s, size_t index,
                                  MemoryRegion *vram, AddressSpace *dma_as,
                                  AppleDisplayPipeV2State *disp_state)
 {
+    if (s->bh != NULL) {
+        qemu_bh_delete(s->bh);
+    }
+    g_free(s->layers[0].buf);
+    g_free(s->layers[1].buf);
+    g_free(s->composite);
     memset(s, 0, sizeof(*s));
     s->index = index;
     s->vram = vram;
@@ -412,39 +680,51 @@ AppleDisplayPipeV2State *apple_displaypipe_v2_create(MachineState *machine,
     return s;
 }
 
-static void apple_displaypipe_v2_draw_row(void *opaque, uint8_t *dest,
-                                          const uint8_t *src, int width,
-                                          int dest_pitch)
-{
-    while (width--) {
-        uint32_t colour = ldl_le_p(src);
-        src += sizeof(colour);
-        memcpy(dest, &colour, sizeof(colour));
-        dest += sizeof(colour);
-    }
-}
-
 static void apple_displaypipe_v2_gfx_update(void *opaque)
 {
     AppleDisplayPipeV2State *s = APPLE_DISPLAYPIPE_V2(opaque);
-    DisplaySurface *surface = qemu_console_surface(s->console);
-
-    int stride = s->width * sizeof(uint32_t);
-    int first = 0, last = 0;
+    DirtyBitmapSnapshot *snap;
+    hwaddr stride = s->width * sizeof(uint32_t);
+    int y, first = -1;
+
+    if (s->invalidate) {
+        s->invalidate = false;
+        memory_region_reset_dirty(&s->vram, 0, stride * s->height,
+                                  DIRTY_MEMORY_VGA);
+        dpy_gfx_update_full(s->console);
+        return;
+    }
 
-    if (!s->vram_section.mr) {
-        framebuffer_update_memory_section(&s->vram_section, &s->vram, 0,
-                                          s->height, stride);
+    // The console surface is backed by VRAM itself, only tell the UI which
+    // rows have been written to since the last refresh.
+    snap = memory_region_snapshot_and_clear_dirty(
+        &s->vram, 0, stride * s->height, DIRTY_MEMORY_VGA);
+    for (y = 0; y < s->height; y++) {
+        if (memory_region_snapshot_get_dirty(&s->vram, snap, y * stride,
+                                             stride)) {
+            if (first < 0) {
+                first = y;
+            }
+        } else if (first >= 0) {
+            dpy_gfx_update(s->console, 0, first, s->width, y - first);
+            first = -1;
+        }
     }
-    framebuffer_update_display(surface, &s->vram_section, s->width, s->height,
-                               stride, stride, 0, 0,
-                               apple_displaypipe_v2_draw_row, s, &first, &last);
     if (first >= 0) {
-        dpy_gfx_update(s->console, 0, first, s->width, last - first + 1);
+        dpy_gfx_update(s->console, 0, first, s->width, y - first);
     }
+    g_free(snap);
+}
+
+static void apple_displaypipe_v2_invalidate(void *opaque)
+{
+    AppleDisplayPipeV2State *s = APPLE_DISPLAYPIPE_V2(opaque);
+
+    s->invalidate = true;
 }
 
 static const GraphicHwOps apple_displaypipe_v2_ops = {
+    .invalidate = apple_displaypipe_v2_invalidate,
     .gfx_update = apple_displaypipe_v2_gfx_update,
 };
 
@@ -461,9 +741,15 @@ static void apple_displaypipe_v2_reset(DeviceState *dev)
 static void apple_displaypipe_v2_realize(DeviceState *dev, Error **errp)
 {
     AppleDisplayPipeV2State *s = APPLE_DISPLAYPIPE_V2(dev);
+    DisplaySurface *surface;
 
     s->console = graphic_console_init(dev, 0, &apple_displaypipe_v2_ops, s);
-    qemu_console_resize(s->console, s->width, s->height);
+    surface = qemu_create_displaysurface_from(
+        s->width, s->height, PIXMAN_LE_x8r8g8b8, s->width * sizeof(uint32_t),
+        memory_region_get_ram_ptr(&s->vram));
+    dpy_gfx_replace_surface(s->console, surface);
+    memory_region_set_log(&s->vram, true, DIRTY_MEMORY_VGA);
+    s->invalidate = true;
 }
 
 static Property apple_displaypipe_v2_props[] = {
@@ -112,7 +112,9 @@ static inline uint64_t apple_aic_emulate_timer(void)
 }
 
 /*
- * Check state and interrupt cpus, call with mutex locked
+ * Check state and interrupt cpus, call with mutex locked.
+ * Called synchronously whenever the pending, mask or destination state
+ * changes; only deferred IPIs go through the timer.
  */
 static void apple_aic_update(AppleAICState *s)
 {
@@ -120,11 +122,6 @@ static void apple_aic_update(AppleAICState *s)
     uint32_t potential = 0;
     int i;
 
-    for (i = 0; i < s->numCPU; i++) {
-        s->cpus[i].pendingIPI |= s->cpus[i].deferredIPI;
-        s->cpus[i].deferredIPI = 0;
-    }
-
     for (i = 0; i < s->numCPU; i++) {
         if ((s->cpus[i].pendingIPI & AIC_IPI_SELF) & (~s->cpus[i].ipi_mask)) {
             intr |= (1 << i);
@@ -178,22 +175,39 @@ static void apple_aic_set_irq(void *opaque, int irq, int level)
         trace_aic_set_irq(irq, level);
         if (level) {
             set_bit(irq, (unsigned long *)s->eir_state);
+            apple_aic_update(s);
         } else {
             clear_bit(irq, (unsigned long *)s->eir_state);
         }
     }
 }
 
+/*
+ * Deliver deferred IPIs once the wait time has elapsed.
+ */
 static void apple_aic_tick(void *opaque)
 {
     AppleAICState *s = APPLE_AIC(opaque);
+    int i;
 
     WITH_QEMU_LOCK_GUARD(&s->mutex)
     {
+        for (i = 0; i < s->numCPU; i++) {
+            s->cpus[i].pendingIPI |= s->cpus[i].deferredIPI;
+            s->cpus[i].deferredIPI = 0;
+        }
         apple_aic_update(s);
     }
+}
 
-    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + kAICWT);
+/*
+ * Arm the deferred IPI timer, call with mutex locked
+ */
+static void apple_aic_defer(AppleAICState *s)
+{
+    if (!timer_pending(s->timer)) {
+        timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + kAICWT);
+    }
 }
 
 static void apple_aic_reset(DeviceState *dev)
@@ -243,18 +257,13 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
             for (i = 0; i < s->numCPU; i++) {
                 if (val & (1 << i)) {
                     set_bit(o->cpu_id, (unsigned long *)&s->cpus[i].pendingIPI);
-                    if (~s->cpus[i].ipi_mask & AIC_IPI_NORMAL) {
-                        qemu_irq_raise(s->cpus[i].irq);
-                    }
                 }
             }
 
             if (val & AIC_IPI_SELF) {
                 o->pendingIPI |= AIC_IPI_SELF;
-                if (~o->ipi_mask & AIC_IPI_SELF) {
-                    qemu_irq_raise(o->irq);
-                }
             }
+            apple_aic_update(s);
             break;
         }
 
@@ -280,6 +289,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
 
         case REG_AIC_IPI_MASK_CLR:
             o->ipi_mask &= ~(val & (AIC_IPI_NORMAL | AIC_IPI_SELF));
+            apple_aic_update(s);
             break;
 
         case REG_AIC_IPI_DEFER_SET: {
@@ -295,6 +305,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
             if (val & AIC_IPI_SELF) {
                 o->deferredIPI |= AIC_IPI_SELF;
             }
+            apple_aic_defer(s);
             break;
         }
 
@@ -320,6 +331,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
                 break;
             }
             s->eir_dest[vector] = val;
+            apple_aic_update(s);
             break;
         }
 
@@ -329,6 +341,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
                 break;
             }
             s->eir_state[eir] |= val;
+            apple_aic_update(s);
             break;
         }
 
@@ -371,6 +384,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
             }
             s->eir_mask_once[eir] &= s->eir_mask[eir];
 #endif
+            apple_aic_update(s);
             break;
         }
 
@@ -417,32 +431,33 @@ static uint64_t apple_aic_read(void *opaque, hwaddr addr, unsigned size)
             return o->cpu_id;
 
         case REG_AIC_IACK: {
+            uint64_t val = kAIC_INT_SPURIOUS;
             int i;
 
             qemu_irq_lower(o->irq);
             if (o->pendingIPI & AIC_IPI_SELF & ~o->ipi_mask) {
                 o->ipi_mask |= AIC_IPI_SELF;
-                return kAIC_INT_IPI | kAIC_INT_IPI_SELF;
-            }
-
-            if (~o->ipi_mask & AIC_IPI_NORMAL) {
-                if (o->pendingIPI & ((1 << s->numCPU) - 1)) {
-                    o->ipi_mask |= AIC_IPI_NORMAL;
-                    return kAIC_INT_IPI | kAIC_INT_IPI_NORM;
-                }
-            }
-
-            i = -1;
-            while ((i = find_next_bit((unsigned long *)s->eir_state, s->numIRQ,
-                                      i + 1)) < s->numIRQ) {
-                if (test_bit(i, (unsigned long *)s->eir_mask) == 0) {
-                    if (s->eir_dest[i] & (1 << o->cpu_id)) {
+                val = kAIC_INT_IPI | kAIC_INT_IPI_SELF;
+            } else if ((~o->ipi_mask & AIC_IPI_NORMAL) &&
+                       (o->pendingIPI & ((1 << s->numCPU) - 1))) {
+                o->ipi_mask |= AIC_IPI_NORMAL;
+                val = kAIC_INT_IPI | kAIC_INT_IPI_NORM;
+            } else {
+                i = -1;
+                while ((i = find_next_bit((unsigned long *)s->eir_state,
+                                          s->numIRQ, i + 1)) < s->numIRQ) {
+                    if (test_bit(i, (unsigned long *)s->eir_mask) == 0 &&
+                        (s->eir_dest[i] & (1 << o->cpu_id))) {
                         set_bit(i, (unsigned long *)s->eir_mask);
-                        return kAIC_INT_EXT | AIC_INT_EXTID(i);
+                        val = kAIC_INT_EXT | AIC_INT_EXTID(i);
+                        break;
                     }
                 }
             }
-            return kAIC_INT_SPURIOUS;
+
+            /* Re-raise the line if anything else is still pending. */
+            apple_aic_update(s);
+            return val;
         }
 
         case REG_AIC_EIR_DEST(0)... REG_AIC_EIR_DEST(AIC_INT_COUNT): {
@@ -560,7 +575,6 @@ static void apple_aic_realize(DeviceState *dev, struct Error **errp)
 #endif
 
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_aic_tick, dev);
-    timer_mod_ns(s->timer, kAICWT);
     msi_nonbroken = true;
 }
 
@@ -627,10 +641,27 @@ static const VMStateDescription vmstate_apple_aic_cpu = {
         }
 };
 
+static int apple_aic_post_load(void *opaque, int version_id)
+{
+    AppleAICState *s = APPLE_AIC(opaque);
+    int i;
+
+    QEMU_LOCK_GUARD(&s->mutex);
+    for (i = 0; i < s->numCPU; i++) {
+        if (s->cpus[i].deferredIPI) {
+            apple_aic_defer(s);
+            break;
+        }
+    }
+    apple_aic_update(s);
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_aic = {
     .name = "apple_aic",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = apple_aic_post_load,
     .fields =
         (VMStateField[]){
             VMSTATE_UINT32(numEIR, AppleAICState),
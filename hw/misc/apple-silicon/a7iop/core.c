@@ -2,14 +2,20 @@
 #include "hw/misc/apple-silicon/a7iop/core.h"
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
 #include "hw/misc/apple-silicon/a7iop/private.h"
+#include "migration/vmstate.h"
 #include "qemu/bitops.h"
 #include "qemu/lockable.h"
 
 #define CPU_CTRL_RUN BIT(4)
 
-void apple_a7iop_send_ap(AppleA7IOP *s, AppleA7IOPMessage *msg)
+bool apple_a7iop_send_ap(AppleA7IOP *s, AppleA7IOPMessage *msg)
 {
-    apple_a7iop_mailbox_send_ap(s->iop_mailbox, msg);
+    return apple_a7iop_mailbox_send_ap(s->iop_mailbox, msg);
+}
+
+void apple_a7iop_set_ap_drain_bh(AppleA7IOP *s, QEMUBH *bh)
+{
+    s->ap_mailbox->drain_bh = bh;
 }
 
 AppleA7IOPMessage *apple_a7iop_recv_ap(AppleA7IOP *s)
@@ -17,9 +23,9 @@ AppleA7IOPMessage *apple_a7iop_recv_ap(AppleA7IOP *s)
     return apple_a7iop_mailbox_recv_ap(s->iop_mailbox);
 }
 
-void apple_a7iop_send_iop(AppleA7IOP *s, AppleA7IOPMessage *msg)
+bool apple_a7iop_send_iop(AppleA7IOP *s, AppleA7IOPMessage *msg)
 {
-    apple_a7iop_mailbox_send_iop(s->ap_mailbox, msg);
+    return apple_a7iop_mailbox_send_iop(s->ap_mailbox, msg);
 }
 
 AppleA7IOPMessage *apple_a7iop_recv_iop(AppleA7IOP *s)
@@ -143,6 +149,18 @@ static void apple_a7iop_unrealize(DeviceState *opaque)
     qdev_unrealize(DEVICE(s->ap_mailbox));
 }
 
+const VMStateDescription vmstate_apple_a7iop = {
+    .name = "apple_a7iop",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT32(cpu_status, AppleA7IOP),
+            VMSTATE_UINT32(cpu_ctrl, AppleA7IOP),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
 static void apple_a7iop_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc;
@@ -152,6 +170,7 @@ static void apple_a7iop_class_init(ObjectClass *oc, void *data)
     dc->realize = apple_a7iop_realize;
     dc->unrealize = apple_a7iop_unrealize;
     dc->desc = "Apple A7IOP";
+    dc->vmsd = &vmstate_apple_a7iop;
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
@@ -6,6 +6,8 @@
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
 #include "hw/qdev-core.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
+#include "qemu/atomic.h"
 #include "qemu/bitops.h"
 #include "qemu/lockable.h"
 #include "qemu/log.h"
@@ -15,6 +17,8 @@
 
 #define MAX_MESSAGE_COUNT 15
 
+QEMU_BUILD_BUG_ON(MAX_MESSAGE_COUNT > APPLE_A7IOP_MAILBOX_RING_SIZE);
+
 #define CTRL_ENABLE_SHIFT 0
 #define CTRL_ENABLE_MASK BIT(CTRL_ENABLE_SHIFT)
 #define CTRL_ENABLE(v) (((v) << CTRL_ENABLE_SHIFT) & CTRL_ENABLE_MASK)
@@ -59,6 +63,47 @@ static inline bool ap_nonempty_is_unmasked(uint32_t int_mask)
     return (int_mask & AP_NONEMPTY) == 0;
 }
 
+static inline uint32_t apple_a7iop_mailbox_count(AppleA7IOPMailbox *s)
+{
+    return qatomic_load_acquire(&s->tail) - qatomic_load_acquire(&s->head);
+}
+
+/*
+ * Single-producer/single-consumer ring. Producer and consumer each own one
+ * index, so pushing and popping need no lock.
+ */
+static bool apple_a7iop_mailbox_push(AppleA7IOPMailbox *s,
+                                     const AppleA7IOPMessage *msg)
+{
+    uint32_t tail = qatomic_read(&s->tail);
+    uint32_t head = qatomic_load_acquire(&s->head);
+
+    if (tail - head >= MAX_MESSAGE_COUNT) {
+        return false;
+    }
+
+    s->ring[tail % APPLE_A7IOP_MAILBOX_RING_SIZE] = *msg;
+    qatomic_store_release(&s->tail, tail + 1);
+    return true;
+}
+
+static bool apple_a7iop_mailbox_pop(AppleA7IOPMailbox *s,
+                                    AppleA7IOPMessage *msg)
+{
+    uint32_t head = qatomic_read(&s->head);
+    uint32_t tail = qatomic_load_acquire(&s->tail);
+
+    if (head == tail) {
+        return false;
+    }
+
+    *msg = s->ring[head % APPLE_A7IOP_MAILBOX_RING_SIZE];
+    msg->flags |= CTRL_COUNT(tail - head);
+    qatomic_store_release(&s->head, head + 1);
+    return true;
+}
+
+/* Call with s->lock held */
 static void apple_a7iop_mailbox_update_irq(AppleA7IOPMailbox *s)
 {
     bool iop_empty;
@@ -70,10 +115,10 @@ static void apple_a7iop_mailbox_update_irq(AppleA7IOPMailbox *s)
     bool ap_nonempty_unmasked;
     bool ap_empty_unmasked;
 
-    iop_empty = QTAILQ_EMPTY(&s->iop_mailbox->inbox);
-    ap_empty = QTAILQ_EMPTY(&s->ap_mailbox->inbox);
-    iop_underflow = s->iop_mailbox->underflow;
-    ap_underflow = s->ap_mailbox->underflow;
+    iop_empty = apple_a7iop_mailbox_count(s->iop_mailbox) == 0;
+    ap_empty = apple_a7iop_mailbox_count(s->ap_mailbox) == 0;
+    iop_underflow = qatomic_read(&s->iop_mailbox->underflow);
+    ap_underflow = qatomic_read(&s->ap_mailbox->underflow);
     iop_nonempty_unmasked = iop_nonempty_is_unmasked(s->int_mask);
     iop_empty_unmasked = iop_empty_is_unmasked(s->int_mask);
     ap_nonempty_unmasked = ap_nonempty_is_unmasked(s->int_mask);
@@ -94,133 +139,180 @@ static void apple_a7iop_mailbox_update_irq(AppleA7IOPMailbox *s)
                  ap_empty_unmasked && ap_empty);
 }
 
+/*
+ * Single IRQ update after a ring operation on @target issued through @s.
+ */
+static void apple_a7iop_mailbox_notify(AppleA7IOPMailbox *s,
+                                       AppleA7IOPMailbox *target)
+{
+    WITH_QEMU_LOCK_GUARD(&s->lock)
+    {
+        apple_a7iop_mailbox_update_irq(s);
+    }
+    if (target != s) {
+        WITH_QEMU_LOCK_GUARD(&target->lock)
+        {
+            apple_a7iop_mailbox_update_irq(target);
+        }
+    }
+}
+
 bool apple_a7iop_mailbox_is_empty(AppleA7IOPMailbox *s)
 {
-    QEMU_LOCK_GUARD(&s->lock);
-    if (s->underflow) {
+    if (qatomic_read(&s->underflow)) {
         return true;
     }
-    return QTAILQ_EMPTY(&s->inbox);
+    return apple_a7iop_mailbox_count(s) == 0;
 }
 
-static void apple_a7iop_mailbox_send(AppleA7IOPMailbox *s,
-                                     AppleA7IOPMessage *msg)
+static bool apple_a7iop_mailbox_send(AppleA7IOPMailbox *s,
+                                     AppleA7IOPMailbox *target,
+                                     const AppleA7IOPMessage *msg)
 {
     g_assert_nonnull(msg);
 
-    QEMU_LOCK_GUARD(&s->lock);
-    trace_apple_a7iop_mailbox_send(s->role, msg->endpoint, msg->data[0],
+    trace_apple_a7iop_mailbox_send(target->role, msg->endpoint, msg->data[0],
                                    msg->data[1]);
-    QTAILQ_INSERT_TAIL(&s->inbox, msg, entry);
-    s->count++;
-    apple_a7iop_mailbox_update_irq(s);
+    if (!apple_a7iop_mailbox_push(target, msg)) {
+        return false;
+    }
 
-    if (s->bh != NULL) {
-        qemu_bh_schedule(s->bh);
+    apple_a7iop_mailbox_notify(s, target);
+
+    if (target->bh != NULL) {
+        qemu_bh_schedule(target->bh);
     }
+    return true;
 }
 
-void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
+static void apple_a7iop_mailbox_post(AppleA7IOPMailbox *s,
+                                     AppleA7IOPMailbox *target,
+                                     const AppleA7IOPMessage *msg)
 {
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        if (!s->ap_dir_en) {
-            qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
-                          __FUNCTION__, s->role);
-            return;
-        }
+    if (!apple_a7iop_mailbox_send(s, target, msg)) {
+        qatomic_set(&target->overflow, true);
+        qemu_log_mask(LOG_GUEST_ERROR, "%s %s overflowed.\n", __FUNCTION__,
+                      target->role);
     }
+}
 
-    apple_a7iop_mailbox_send(s->ap_mailbox, msg);
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        apple_a7iop_mailbox_update_irq(s);
+void apple_a7iop_mailbox_post_ap(AppleA7IOPMailbox *s,
+                                 const AppleA7IOPMessage *msg)
+{
+    if (!qatomic_read(&s->ap_dir_en)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
+                      __FUNCTION__, s->role);
+        return;
     }
+
+    apple_a7iop_mailbox_post(s, s->ap_mailbox, msg);
 }
 
-void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
+void apple_a7iop_mailbox_post_iop(AppleA7IOPMailbox *s,
+                                  const AppleA7IOPMessage *msg)
 {
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        if (!s->iop_dir_en) {
-            qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
-                          __FUNCTION__, s->role);
-            return;
-        }
+    if (!qatomic_read(&s->iop_dir_en)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
+                      __FUNCTION__, s->role);
+        return;
     }
 
-    apple_a7iop_mailbox_send(s->iop_mailbox, msg);
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        apple_a7iop_mailbox_update_irq(s);
+    apple_a7iop_mailbox_post(s, s->iop_mailbox, msg);
+}
+
+/*
+ * Device-side producers must not lose messages to a full ring: on failure
+ * the caller keeps @msg and retries once the consumer drains (see drain_bh).
+ * Messages for a disabled direction are dropped like guest writes are.
+ */
+bool apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
+{
+    if (!qatomic_read(&s->ap_dir_en)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
+                      __FUNCTION__, s->role);
+    } else if (!apple_a7iop_mailbox_send(s, s->ap_mailbox, msg)) {
+        return false;
     }
+    g_free(msg);
+    return true;
 }
 
-static AppleA7IOPMessage *apple_a7iop_mailbox_recv(AppleA7IOPMailbox *s)
+bool apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
 {
-    AppleA7IOPMessage *msg;
+    if (!qatomic_read(&s->iop_dir_en)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
+                      __FUNCTION__, s->role);
+    } else if (!apple_a7iop_mailbox_send(s, s->iop_mailbox, msg)) {
+        return false;
+    }
+    g_free(msg);
+    return true;
+}
 
-    QEMU_LOCK_GUARD(&s->lock);
-    if (s->underflow) {
-        return NULL;
+static bool apple_a7iop_mailbox_recv(AppleA7IOPMailbox *s,
+                                     AppleA7IOPMailbox *target,
+                                     AppleA7IOPMessage *msg)
+{
+    if (qatomic_read(&target->underflow)) {
+        return false;
     }
-    msg = QTAILQ_FIRST(&s->inbox);
-    if (!msg) {
-        s->underflow = true;
+    if (!apple_a7iop_mailbox_pop(target, msg)) {
+        qatomic_set(&target->underflow, true);
         qemu_log_mask(LOG_GUEST_ERROR, "%s %s underflowed.\n", __FUNCTION__,
-                      s->role);
-        apple_a7iop_mailbox_update_irq(s);
-        return NULL;
+                      target->role);
+        apple_a7iop_mailbox_notify(s, target);
+        return false;
     }
-    QTAILQ_REMOVE(&s->inbox, msg, entry);
-    msg->flags |= CTRL_COUNT(s->count);
-    trace_apple_a7iop_mailbox_recv(s->role, msg->endpoint, msg->data[0],
+    trace_apple_a7iop_mailbox_recv(target->role, msg->endpoint, msg->data[0],
                                    msg->data[1]);
-    s->count--;
-    apple_a7iop_mailbox_update_irq(s);
-    return msg;
+    apple_a7iop_mailbox_notify(s, target);
+
+    if (target->drain_bh != NULL) {
+        qemu_bh_schedule(target->drain_bh);
+    }
+    return true;
 }
 
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s)
+bool apple_a7iop_mailbox_fetch_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
 {
-    AppleA7IOPMessage *msg;
-
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        if (!s->iop_dir_en) {
-            qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
-                          __FUNCTION__, s->role);
-            return NULL;
-        }
+    if (!qatomic_read(&s->iop_dir_en)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
+                      __FUNCTION__, s->role);
+        return false;
     }
 
-    msg = apple_a7iop_mailbox_recv(s->iop_mailbox);
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        apple_a7iop_mailbox_update_irq(s);
+    return apple_a7iop_mailbox_recv(s, s->iop_mailbox, msg);
+}
+
+bool apple_a7iop_mailbox_fetch_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
+{
+    if (!qatomic_read(&s->ap_dir_en)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
+                      __FUNCTION__, s->role);
+        return false;
     }
-    return msg;
+
+    return apple_a7iop_mailbox_recv(s, s->ap_mailbox, msg);
 }
 
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s)
+AppleA7IOPMessage *apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s)
 {
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg = { 0 };
 
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        if (!s->ap_dir_en) {
-            qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
-                          __FUNCTION__, s->role);
-            return NULL;
-        }
+    if (!apple_a7iop_mailbox_fetch_iop(s, &msg)) {
+        return NULL;
     }
+    return g_memdup2(&msg, sizeof(msg));
+}
 
-    msg = apple_a7iop_mailbox_recv(s->ap_mailbox);
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        apple_a7iop_mailbox_update_irq(s);
+AppleA7IOPMessage *apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s)
+{
+    AppleA7IOPMessage msg = { 0 };
+
+    if (!apple_a7iop_mailbox_fetch_ap(s, &msg)) {
+        return NULL;
     }
-    return msg;
+    return g_memdup2(&msg, sizeof(msg));
 }
 
 uint32_t apple_a7iop_mailbox_get_int_mask(AppleA7IOPMailbox *s)
@@ -245,49 +337,36 @@ void apple_a7iop_mailbox_clear_int_mask(AppleA7IOPMailbox *s, uint32_t value)
 
 static inline uint32_t apple_a7iop_mailbox_ctrl(AppleA7IOPMailbox *s)
 {
-    QEMU_LOCK_GUARD(&s->lock);
-    if (s->underflow) {
-        return CTRL_UNDERFLOW(s->underflow);
+    uint32_t count;
+
+    if (qatomic_read(&s->underflow)) {
+        return CTRL_UNDERFLOW(1);
     }
-    return CTRL_FULL(s->count >= MAX_MESSAGE_COUNT) |
-           CTRL_EMPTY(QTAILQ_EMPTY(&s->inbox)) |
-           CTRL_COUNT(MIN(s->count, MAX_MESSAGE_COUNT));
+    count = apple_a7iop_mailbox_count(s);
+    return CTRL_FULL(count >= MAX_MESSAGE_COUNT) | CTRL_EMPTY(count == 0) |
+           CTRL_OVERFLOW(qatomic_read(&s->overflow)) | CTRL_COUNT(count);
 }
 
 uint32_t apple_a7iop_mailbox_get_iop_ctrl(AppleA7IOPMailbox *s)
 {
-    uint32_t val;
-
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        val = CTRL_ENABLE(s->iop_dir_en);
-    }
-    val |= apple_a7iop_mailbox_ctrl(s->iop_mailbox);
-    return val;
+    return CTRL_ENABLE(qatomic_read(&s->iop_dir_en)) |
+           apple_a7iop_mailbox_ctrl(s->iop_mailbox);
 }
 
 void apple_a7iop_mailbox_set_iop_ctrl(AppleA7IOPMailbox *s, uint32_t value)
 {
-    QEMU_LOCK_GUARD(&s->lock);
-    s->iop_dir_en = (value & CTRL_ENABLE_MASK) != 0;
+    qatomic_set(&s->iop_dir_en, (value & CTRL_ENABLE_MASK) != 0);
 }
 
 uint32_t apple_a7iop_mailbox_get_ap_ctrl(AppleA7IOPMailbox *s)
 {
-    uint32_t val;
-
-    WITH_QEMU_LOCK_GUARD(&s->lock)
-    {
-        val = CTRL_ENABLE(s->ap_dir_en);
-    }
-    val |= apple_a7iop_mailbox_ctrl(s->ap_mailbox);
-    return val;
+    return CTRL_ENABLE(qatomic_read(&s->ap_dir_en)) |
+           apple_a7iop_mailbox_ctrl(s->ap_mailbox);
 }
 
 void apple_a7iop_mailbox_set_ap_ctrl(AppleA7IOPMailbox *s, uint32_t value)
 {
-    QEMU_LOCK_GUARD(&s->lock);
-    s->ap_dir_en = (value & CTRL_ENABLE_MASK) != 0;
+    qatomic_set(&s->ap_dir_en, (value & CTRL_ENABLE_MASK) != 0);
 }
 
 AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
@@ -309,7 +388,6 @@ AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
     s->iop_mailbox = iop_mailbox ? iop_mailbox : s;
     s->ap_mailbox = ap_mailbox ? ap_mailbox : s;
     s->bh = bh;
-    QTAILQ_INIT(&s->inbox);
     qemu_mutex_init(&s->lock);
     for (i = 0; i < APPLE_A7IOP_IRQ_MAX; i++) {
         sysbus_init_irq(sbd, s->irqs + i);
@@ -331,29 +409,75 @@ AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
 static void apple_a7iop_mailbox_reset(DeviceState *dev)
 {
     AppleA7IOPMailbox *s;
-    AppleA7IOPMessage *msg;
 
     s = APPLE_A7IOP_MAILBOX(dev);
 
     g_assert_true(s->iop_mailbox != s->ap_mailbox);
     QEMU_LOCK_GUARD(&s->lock);
-    s->count = 0;
+    s->head = 0;
+    s->tail = 0;
+    memset(s->ring, 0, sizeof(s->ring));
     s->iop_dir_en = true;
     s->ap_dir_en = true;
     s->underflow = false;
+    s->overflow = false;
     memset(s->iop_recv_reg, 0, sizeof(s->iop_recv_reg));
     memset(s->ap_recv_reg, 0, sizeof(s->ap_recv_reg));
     memset(s->iop_send_reg, 0, sizeof(s->iop_send_reg));
     memset(s->ap_send_reg, 0, sizeof(s->ap_send_reg));
+    apple_a7iop_mailbox_update_irq(s);
+}
 
-    while (!QTAILQ_EMPTY(&s->inbox)) {
-        msg = QTAILQ_FIRST(&s->inbox);
-        QTAILQ_REMOVE(&s->inbox, msg, entry);
-        g_free(msg);
+static int apple_a7iop_mailbox_post_load(void *opaque, int version_id)
+{
+    AppleA7IOPMailbox *s = APPLE_A7IOP_MAILBOX(opaque);
+
+    if (s->tail - s->head > MAX_MESSAGE_COUNT) {
+        return -EINVAL;
     }
-    apple_a7iop_mailbox_update_irq(s);
+    if (s->bh != NULL && s->tail != s->head) {
+        qemu_bh_schedule(s->bh);
+    }
+    return 0;
 }
 
+const VMStateDescription vmstate_apple_a7iop_message = {
+    .name = "apple_a7iop_message",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT64_ARRAY(data, AppleA7IOPMessage, 2),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static const VMStateDescription vmstate_apple_a7iop_mailbox = {
+    .name = "apple_a7iop_mailbox",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = apple_a7iop_mailbox_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_STRUCT_ARRAY(ring, AppleA7IOPMailbox,
+                                 APPLE_A7IOP_MAILBOX_RING_SIZE, 1,
+                                 vmstate_apple_a7iop_message,
+                                 AppleA7IOPMessage),
+            VMSTATE_UINT32(head, AppleA7IOPMailbox),
+            VMSTATE_UINT32(tail, AppleA7IOPMailbox),
+            VMSTATE_BOOL(iop_dir_en, AppleA7IOPMailbox),
+            VMSTATE_BOOL(ap_dir_en, AppleA7IOPMailbox),
+            VMSTATE_BOOL(underflow, AppleA7IOPMailbox),
+            VMSTATE_BOOL(overflow, AppleA7IOPMailbox),
+            VMSTATE_UINT32(int_mask, AppleA7IOPMailbox),
+            VMSTATE_UINT8_ARRAY(iop_recv_reg, AppleA7IOPMailbox, 16),
+            VMSTATE_UINT8_ARRAY(ap_recv_reg, AppleA7IOPMailbox, 16),
+            VMSTATE_UINT8_ARRAY(iop_send_reg, AppleA7IOPMailbox, 16),
+            VMSTATE_UINT8_ARRAY(ap_send_reg, AppleA7IOPMailbox, 16),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
 static void apple_a7iop_mailbox_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc;
@@ -362,6 +486,7 @@ static void apple_a7iop_mailbox_class_init(ObjectClass *klass, void *data)
 
     dc->reset = apple_a7iop_mailbox_reset;
     dc->desc = "Apple A7IOP Mailbox";
+    dc->vmsd = &vmstate_apple_a7iop_mailbox;
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
@@ -3,6 +3,12 @@
 
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
 
+void apple_a7iop_mailbox_post_iop(AppleA7IOPMailbox *s,
+                                  const AppleA7IOPMessage *msg);
+void apple_a7iop_mailbox_post_ap(AppleA7IOPMailbox *s,
+                                 const AppleA7IOPMessage *msg);
+bool apple_a7iop_mailbox_fetch_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
+bool apple_a7iop_mailbox_fetch_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
 uint32_t apple_a7iop_mailbox_get_int_mask(AppleA7IOPMailbox *s);
 void apple_a7iop_mailbox_set_int_mask(AppleA7IOPMailbox *s, uint32_t value);
 void apple_a7iop_mailbox_clear_int_mask(AppleA7IOPMailbox *s, uint32_t value);
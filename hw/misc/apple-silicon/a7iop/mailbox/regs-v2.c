@@ -20,7 +20,7 @@ static void apple_a7iop_mailbox_reg_write_v2(void *opaque, hwaddr addr,
                                              const uint64_t data, unsigned size)
 {
     AppleA7IOPMailbox *s;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg = { 0 };
 
     s = APPLE_A7IOP_MAILBOX(opaque);
 
@@ -43,10 +43,9 @@ static void apple_a7iop_mailbox_reg_write_v2(void *opaque, hwaddr addr,
         qemu_mutex_lock(&s->lock);
         memcpy(s->iop_send_reg + (addr - REG_IOP_SEND0), &data, size);
         if (addr + size == REG_IOP_SEND1 + 4) {
-            msg = g_new0(AppleA7IOPMessage, 1);
-            memcpy(msg->data, s->iop_send_reg, sizeof(msg->data));
+            memcpy(msg.data, s->iop_send_reg, sizeof(msg.data));
             qemu_mutex_unlock(&s->lock);
-            apple_a7iop_mailbox_send_iop(s, msg);
+            apple_a7iop_mailbox_post_iop(s, &msg);
         } else {
             qemu_mutex_unlock(&s->lock);
         }
@@ -57,10 +56,9 @@ static void apple_a7iop_mailbox_reg_write_v2(void *opaque, hwaddr addr,
         qemu_mutex_lock(&s->lock);
         memcpy(s->ap_send_reg + (addr - REG_AP_SEND0), &data, size);
         if (addr + size == REG_AP_SEND1 + 4) {
-            msg = g_new0(AppleA7IOPMessage, 1);
-            memcpy(msg->data, s->ap_send_reg, sizeof(msg->data));
+            memcpy(msg.data, s->ap_send_reg, sizeof(msg.data));
             qemu_mutex_unlock(&s->lock);
-            apple_a7iop_mailbox_send_ap(s, msg);
+            apple_a7iop_mailbox_post_ap(s, &msg);
         } else {
             qemu_mutex_unlock(&s->lock);
         }
@@ -77,7 +75,8 @@ static uint64_t apple_a7iop_mailbox_reg_read_v2(void *opaque, hwaddr addr,
                                                 unsigned size)
 {
     AppleA7IOPMailbox *s;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg = { 0 };
+    bool has_msg;
     uint64_t ret = 0;
 
     s = APPLE_A7IOP_MAILBOX(opaque);
@@ -92,12 +91,11 @@ static uint64_t apple_a7iop_mailbox_reg_read_v2(void *opaque, hwaddr addr,
     case REG_AP_CTRL:
         return apple_a7iop_mailbox_get_ap_ctrl(s);
     case REG_IOP_RECV0:
-        msg = apple_a7iop_mailbox_recv_iop(s);
+        has_msg = apple_a7iop_mailbox_fetch_iop(s, &msg);
         WITH_QEMU_LOCK_GUARD(&s->lock)
         {
-            if (msg) {
-                memcpy(s->iop_recv_reg, msg->data, sizeof(s->iop_recv_reg));
-                g_free(msg);
+            if (has_msg) {
+                memcpy(s->iop_recv_reg, msg.data, sizeof(s->iop_recv_reg));
             } else {
                 memset(s->iop_recv_reg, 0, sizeof(s->iop_recv_reg));
             }
@@ -110,12 +108,11 @@ static uint64_t apple_a7iop_mailbox_reg_read_v2(void *opaque, hwaddr addr,
         }
         break;
     case REG_AP_RECV0:
-        msg = apple_a7iop_mailbox_recv_ap(s);
+        has_msg = apple_a7iop_mailbox_fetch_ap(s, &msg);
         WITH_QEMU_LOCK_GUARD(&s->lock)
         {
-            if (msg) {
-                memcpy(s->ap_recv_reg, msg->data, sizeof(s->ap_recv_reg));
-                g_free(msg);
+            if (has_msg) {
+                memcpy(s->ap_recv_reg, msg.data, sizeof(s->ap_recv_reg));
             } else {
                 memset(s->ap_recv_reg, 0, sizeof(s->ap_recv_reg));
             }
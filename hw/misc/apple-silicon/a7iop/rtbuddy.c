@@ -2,6 +2,7 @@
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
 #include "hw/misc/apple-silicon/a7iop/private.h"
 #include "hw/misc/apple-silicon/a7iop/rtbuddy.h"
+#include "migration/vmstate.h"
 #include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "trace.h"
@@ -39,10 +40,40 @@ static inline AppleA7IOPMessage *apple_rtbuddy_construct_msg(uint32_t ep,
     return msg;
 }
 
+static void apple_rtbuddy_flush_outbox(AppleRTBuddy *s)
+{
+    AppleA7IOPMessage *msg;
+
+    QEMU_LOCK_GUARD(&s->outbox_lock);
+    while (!QTAILQ_EMPTY(&s->outbox)) {
+        msg = QTAILQ_FIRST(&s->outbox);
+        QTAILQ_REMOVE(&s->outbox, msg, entry);
+        if (!apple_a7iop_send_ap(APPLE_A7IOP(s), msg)) {
+            QTAILQ_INSERT_HEAD(&s->outbox, msg, entry);
+            break;
+        }
+    }
+}
+
+static void apple_rtbuddy_outbox_bh(void *opaque)
+{
+    apple_rtbuddy_flush_outbox(APPLE_RTBUDDY(opaque));
+}
+
+// Queued behind anything still waiting so ordering is preserved.
+static void apple_rtbuddy_queue_msg(AppleRTBuddy *s, AppleA7IOPMessage *msg)
+{
+    WITH_QEMU_LOCK_GUARD(&s->outbox_lock)
+    {
+        QTAILQ_INSERT_TAIL(&s->outbox, msg, entry);
+    }
+    apple_rtbuddy_flush_outbox(s);
+}
+
 static inline void apple_rtbuddy_send_msg(AppleRTBuddy *s, uint32_t ep,
                                           uint64_t data)
 {
-    apple_a7iop_send_ap(APPLE_A7IOP(s), apple_rtbuddy_construct_msg(ep, data));
+    apple_rtbuddy_queue_msg(s, apple_rtbuddy_construct_msg(ep, data));
 }
 
 void apple_rtbuddy_send_control_msg(AppleRTBuddy *s, uint32_t ep, uint64_t data)
@@ -136,13 +167,10 @@ static gboolean iop_rollcall(gpointer key, gpointer value, gpointer data)
 
 static void iop_start_rollcall(AppleRTBuddy *s)
 {
-    AppleA7IOP *a7iop;
     AppleRTBuddyRollcallData data = { 0 };
     AppleA7IOPMessage *msg;
     AppleRTBuddyManagementMessage mgmt_msg = { 0 };
 
-    a7iop = APPLE_A7IOP(s);
-
     data.s = s;
     while (!QTAILQ_EMPTY(&s->rollcall)) {
         msg = QTAILQ_FIRST(&s->rollcall);
@@ -160,7 +188,7 @@ static void iop_start_rollcall(AppleRTBuddy *s)
 
     msg = QTAILQ_FIRST(&s->rollcall);
     QTAILQ_REMOVE(&s->rollcall, msg, entry);
-    apple_a7iop_send_ap(a7iop, msg);
+    apple_rtbuddy_queue_msg(s, msg);
 }
 
 static void apple_rtbuddy_handle_mgmt_msg(void *opaque, uint32_t ep,
@@ -234,7 +262,7 @@ static void apple_rtbuddy_handle_mgmt_msg(void *opaque, uint32_t ep,
             } else {
                 AppleA7IOPMessage *m = QTAILQ_FIRST(&s->rollcall);
                 QTAILQ_REMOVE(&s->rollcall, m, entry);
-                apple_a7iop_send_ap(a7iop, m);
+                apple_rtbuddy_queue_msg(s, m);
             }
             break;
         }
@@ -350,6 +378,10 @@ void apple_rtbuddy_init(AppleRTBuddy *s, void *opaque, const char *role,
     s->ops = ops;
     QTAILQ_INIT(&s->rollcall);
     qemu_mutex_init(&s->lock);
+    QTAILQ_INIT(&s->outbox);
+    qemu_mutex_init(&s->outbox_lock);
+    s->outbox_bh = qemu_bh_new(apple_rtbuddy_outbox_bh, s);
+    apple_a7iop_set_ap_drain_bh(a7iop, s->outbox_bh);
     apple_rtbuddy_register_control_ep(s, EP_MANAGEMENT, s,
                                       apple_rtbuddy_handle_mgmt_msg);
     apple_rtbuddy_register_control_ep(s, EP_CRASHLOG, s, NULL);
@@ -391,8 +423,68 @@ static void apple_rtbuddy_reset(DeviceState *dev)
         QTAILQ_REMOVE(&s->rollcall, msg, entry);
         g_free(msg);
     }
+
+    QEMU_LOCK_GUARD(&s->outbox_lock);
+    while (!QTAILQ_EMPTY(&s->outbox)) {
+        msg = QTAILQ_FIRST(&s->outbox);
+        QTAILQ_REMOVE(&s->outbox, msg, entry);
+        g_free(msg);
+    }
+}
+
+static bool apple_rtbuddy_outbox_needed(void *opaque)
+{
+    AppleRTBuddy *s = opaque;
+
+    return !QTAILQ_EMPTY(&s->outbox);
+}
+
+static int apple_rtbuddy_post_load(void *opaque, int version_id)
+{
+    AppleRTBuddy *s = opaque;
+
+    if (!QTAILQ_EMPTY(&s->outbox)) {
+        qemu_bh_schedule(s->outbox_bh);
+    }
+    return 0;
 }
 
+static const VMStateDescription vmstate_apple_rtbuddy_outbox = {
+    .name = "apple_rtbuddy/outbox",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = apple_rtbuddy_outbox_needed,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_QTAILQ_V(outbox, AppleRTBuddy, 0,
+                             vmstate_apple_a7iop_message, AppleA7IOPMessage,
+                             entry),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static const VMStateDescription vmstate_apple_rtbuddy = {
+    .name = "apple_rtbuddy",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = apple_rtbuddy_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_STRUCT(parent_obj, AppleRTBuddy, 0, vmstate_apple_a7iop,
+                           AppleA7IOP),
+            VMSTATE_UINT32(ep0_status, AppleRTBuddy),
+            VMSTATE_QTAILQ_V(rollcall, AppleRTBuddy, 0,
+                             vmstate_apple_a7iop_message, AppleA7IOPMessage,
+                             entry),
+            VMSTATE_END_OF_LIST(),
+        },
+    .subsections =
+        (const VMStateDescription *const[]){
+            &vmstate_apple_rtbuddy_outbox,
+            NULL,
+        }
+};
+
 static void apple_rtbuddy_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc;
@@ -402,6 +494,7 @@ static void apple_rtbuddy_class_init(ObjectClass *oc, void *data)
     rtbc = APPLE_RTBUDDY_CLASS(oc);
 
     dc->desc = "Apple RTBuddy IOP";
+    dc->vmsd = &vmstate_apple_rtbuddy;
     device_class_set_parent_reset(dc, apple_rtbuddy_reset, &rtbc->parent_reset);
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
@@ -6,12 +6,16 @@
 #include "hw/misc/apple-silicon/aes_reg.h"
 #include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/rcu.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
 #include "sysemu/dma.h"
 #include "trace.h"
 
@@ -58,6 +62,8 @@ struct AppleAESState {
     AESKey keys[2];
     uint8_t iv[4][16];
     bool stopped;
+    Stat64 data_bytes;
+    Stat64 data_ns;
 };
 
 static uint32_t key_size(uint8_t len)
@@ -171,6 +177,88 @@ static void aes_stop(AppleAESState *s)
     }
 }
 
+static int aes_cipher(AESKey *key, const void *in, void *out, size_t len,
+                      Error **errp)
+{
+    if (key->encrypt) {
+        return qcrypto_cipher_encrypt(key->cipher, in, out, len, errp);
+    }
+    return qcrypto_cipher_decrypt(key->cipher, in, out, len, errp);
+}
+
+static void aes_process_data(AppleAESState *s, AESKey *key, uint8_t *iv,
+                             dma_addr_t source_addr, dma_addr_t dest_addr,
+                             uint32_t len)
+{
+    dma_addr_t source_len = len;
+    dma_addr_t dest_len = len;
+    void *source;
+    void *dest;
+    int64_t start;
+    bool has_iv;
+    Error *local_err = NULL;
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    // ECB has no IV, QCryptoCipher refuses to set or read one.
+    has_iv = key->mode != BLOCK_MODE_ECB;
+    if (has_iv && qcrypto_cipher_setiv(key->cipher, iv, 16, &local_err) < 0) {
+        goto fail;
+    }
+
+    // Cipher straight from and into guest memory when both buffers are
+    // contiguous, and they either do not overlap or are the same buffer.
+    source = dma_memory_map(&s->dma_as, source_addr, &source_len,
+                            DMA_DIRECTION_TO_DEVICE, MEMTXATTRS_UNSPECIFIED);
+    dest = dma_memory_map(&s->dma_as, dest_addr, &dest_len,
+                          DMA_DIRECTION_FROM_DEVICE, MEMTXATTRS_UNSPECIFIED);
+    if (source != NULL && dest != NULL && source_len == len &&
+        dest_len == len &&
+        (source == dest || (uint8_t *)source + len <= (uint8_t *)dest ||
+         (uint8_t *)dest + len <= (uint8_t *)source)) {
+        int ret = aes_cipher(key, source, dest, len, &local_err);
+
+        dma_memory_unmap(&s->dma_as, source, source_len,
+                         DMA_DIRECTION_TO_DEVICE, len);
+        dma_memory_unmap(&s->dma_as, dest, dest_len,
+                         DMA_DIRECTION_FROM_DEVICE, ret < 0 ? 0 : len);
+        if (ret < 0) {
+            goto fail;
+        }
+    } else {
+        g_autofree uint8_t *buffer = NULL;
+
+        if (source != NULL) {
+            dma_memory_unmap(&s->dma_as, source, source_len,
+                             DMA_DIRECTION_TO_DEVICE, 0);
+        }
+        if (dest != NULL) {
+            dma_memory_unmap(&s->dma_as, dest, dest_len,
+                             DMA_DIRECTION_FROM_DEVICE, 0);
+        }
+
+        buffer = g_malloc0(len);
+        dma_memory_read(&s->dma_as, source_addr, buffer, len,
+                        MEMTXATTRS_UNSPECIFIED);
+        if (aes_cipher(key, buffer, buffer, len, &local_err) < 0) {
+            goto fail;
+        }
+        dma_memory_write(&s->dma_as, dest_addr, buffer, len,
+                         MEMTXATTRS_UNSPECIFIED);
+    }
+
+    if (has_iv && qcrypto_cipher_getiv(key->cipher, iv, 16, &local_err) < 0) {
+        goto fail;
+    }
+    stat64_add(&s->data_bytes, len);
+    stat64_add(&s->data_ns, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    return;
+
+fail:
+    qemu_log_mask(LOG_GUEST_ERROR, "%s: %s\n", __func__,
+                  error_get_pretty(local_err));
+    error_free(local_err);
+}
+
 static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
 {
     trace_apple_aes_process_command(COMMAND_OPCODE(cmd->command));
@@ -183,6 +271,11 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
     switch (COMMAND_OPCODE(cmd->command)) {
     case OPCODE_KEY: {
         uint32_t ctx = COMMAND_KEY_COMMAND_KEY_CONTEXT(cmd->command);
+        QCryptoCipherAlgorithm old_algo = s->keys[ctx].algo;
+        block_mode_t old_mode = s->keys[ctx].mode;
+        uint8_t old_key[32];
+        uint32_t old_len = s->keys[ctx].len;
+        memcpy(old_key, s->keys[ctx].key, sizeof(old_key));
         s->keys[ctx].select = COMMAND_KEY_COMMAND_KEY_SELECT(cmd->command);
         s->keys[ctx].algo =
             key_algo(COMMAND_KEY_COMMAND_KEY_LENGTH(cmd->command));
@@ -195,13 +288,21 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
         s->keys[ctx].func = COMMAND_KEY_COMMAND_KEY_FUNC(cmd->command);
         s->keys[ctx].mode = COMMAND_KEY_COMMAND_BLOCK_MODE(cmd->command);
         s->keys[ctx].id = COMMAND_KEY_COMMAND_COMMAND_ID(cmd->command);
-        memcpy(s->keys[ctx].key, &cmd->data[1], s->keys[ctx].len);
+        if (s->keys[ctx].select == KEY_SELECT_SOFTWARE) {
+            memcpy(s->keys[ctx].key, &cmd->data[1], s->keys[ctx].len);
+        }
         if (ctx) {
             s->reg.key_id.context_1 = s->keys[ctx].id;
         } else {
             s->reg.key_id.context_0 = s->keys[ctx].id;
         }
-        if (s->keys[ctx].cipher) {
+        // The guest reloads the same key for every request, keep the cipher
+        // around instead of expanding the key schedule again.
+        if (s->keys[ctx].cipher &&
+            (s->keys[ctx].select != KEY_SELECT_SOFTWARE ||
+             s->keys[ctx].algo != old_algo || s->keys[ctx].mode != old_mode ||
+             s->keys[ctx].len != old_len ||
+             memcmp(s->keys[ctx].key, old_key, old_len) != 0)) {
             qcrypto_cipher_free(s->keys[ctx].cipher);
             s->keys[ctx].cipher = NULL;
         }
@@ -230,9 +331,20 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
                 qatomic_and(&s->reg.int_status.raw,
                             ~AES_BLK_INT_KEY_0_DISABLED);
             }
-            s->keys[ctx].cipher = qcrypto_cipher_new(
-                s->keys[ctx].algo, key_mode(s->keys[ctx].mode),
-                s->keys[ctx].key, s->keys[ctx].len, &error_abort);
+            if (!s->keys[ctx].cipher) {
+                Error *local_err = NULL;
+
+                // A bad mode leaves the context without a cipher, DATA
+                // commands then report it as disabled.
+                s->keys[ctx].cipher = qcrypto_cipher_new(
+                    s->keys[ctx].algo, key_mode(s->keys[ctx].mode),
+                    s->keys[ctx].key, s->keys[ctx].len, &local_err);
+                if (!s->keys[ctx].cipher) {
+                    qemu_log_mask(LOG_GUEST_ERROR, "%s: %s\n", __func__,
+                                  error_get_pretty(local_err));
+                    error_free(local_err);
+                }
+            }
         }
         break;
     }
@@ -248,8 +360,6 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
         uint32_t len = COMMAND_DATA_COMMAND_LENGTH(c->command);
         dma_addr_t source_addr = c->source_addr;
         dma_addr_t dest_addr = c->dest_addr;
-        g_autofree uint8_t *buffer = NULL;
-        g_autofree Error *errp = NULL;
 
         source_addr |=
             ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_SOURCE(c->upper_addr)) << 32;
@@ -270,25 +380,8 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
             break;
         }
 
-        buffer = g_malloc0(len);
-
-        WITH_RCU_READ_LOCK_GUARD()
-        {
-            dma_memory_read(&s->dma_as, source_addr, buffer, len,
-                            MEMTXATTRS_UNSPECIFIED);
-        }
-        qcrypto_cipher_setiv(s->keys[key_ctx].cipher, s->iv[iv_ctx], 16, &errp);
-
-        if (s->keys[key_ctx].encrypt) {
-            qcrypto_cipher_encrypt(s->keys[key_ctx].cipher, buffer, buffer, len,
-                                   &errp);
-        } else {
-            qcrypto_cipher_decrypt(s->keys[key_ctx].cipher, buffer, buffer, len,
-                                   &errp);
-        }
-        qcrypto_cipher_getiv(s->keys[key_ctx].cipher, s->iv[iv_ctx], 16, &errp);
-        dma_memory_write(&s->dma_as, dest_addr, buffer, len,
-                         MEMTXATTRS_UNSPECIFIED);
+        aes_process_data(s, &s->keys[key_ctx], s->iv[iv_ctx], source_addr,
+                         dest_addr, len);
         break;
     }
     case OPCODE_STORE_IV: {
@@ -327,31 +420,49 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
 static void *aes_thread(void *opaque)
 {
     AppleAESState *s = APPLE_AES(opaque);
+    QTAILQ_HEAD(, AESCommand) batch = QTAILQ_HEAD_INITIALIZER(batch);
     rcu_register_thread();
     while (!s->stopped) {
-        AESCommand *cmd = NULL;
+        AESCommand *cmd;
+        uint32_t consumed = 0;
+
+        // Take everything queued so far in one go, and only grab the BQL
+        // for commands that touch registers or when the batch is done.
         WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
         {
-            if (!QTAILQ_EMPTY(&s->queue)) {
-                cmd = QTAILQ_FIRST(&s->queue);
+            while ((cmd = QTAILQ_FIRST(&s->queue)) != NULL) {
                 QTAILQ_REMOVE(&s->queue, cmd, entry);
+                QTAILQ_INSERT_TAIL(&batch, cmd, entry);
             }
         }
-        if (cmd) {
-            if (!aes_process_command(s, cmd)) {
-                bql_lock();
+        while (!s->stopped && (cmd = QTAILQ_FIRST(&batch)) != NULL) {
+            QTAILQ_REMOVE(&batch, cmd, entry);
+            consumed += cmd->data_len;
+            if (aes_process_command(s, cmd)) {
+                s->reg.command_fifo_status.level -= consumed;
+                consumed = 0;
+                aes_update_command_fifo_status(s);
+                bql_unlock();
             }
-            s->reg.command_fifo_status.level -= cmd->data_len;
-            aes_update_command_fifo_status(s);
-            bql_unlock();
 
             if (cmd->data) {
                 g_free(cmd->data);
             }
             g_free(cmd);
         }
+        if (consumed) {
+            bql_lock();
+            s->reg.command_fifo_status.level -= consumed;
+            aes_update_command_fifo_status(s);
+            bql_unlock();
+        }
         WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
         {
+            // Hand back whatever a stop left unprocessed, in order.
+            while ((cmd = QTAILQ_LAST(&batch)) != NULL) {
+                QTAILQ_REMOVE(&batch, cmd, entry);
+                QTAILQ_INSERT_HEAD(&s->queue, cmd, entry);
+            }
             while (QTAILQ_EMPTY(&s->queue) && !s->stopped) {
                 qemu_cond_wait(&s->thread_cond, &s->queue_mutex);
             }
@@ -715,7 +826,7 @@ static int apple_aes_key_post_load(void *opaque, int version_id)
     } else {
         k->disabled = false;
         k->cipher = qcrypto_cipher_new(k->algo, key_mode(k->mode), k->key,
-                                       k->len, &error_abort);
+                                       k->len, NULL);
     }
     return 0;
 }
@@ -793,10 +904,45 @@ static const VMStateDescription vmstate_apple_aes = {
         }
 };
 
+static void apple_aes_get_data_bytes(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    AppleAESState *s = APPLE_AES(obj);
+    uint64_t value = stat64_get(&s->data_bytes);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void apple_aes_get_throughput(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    AppleAESState *s = APPLE_AES(obj);
+    uint64_t bytes = stat64_get(&s->data_bytes);
+    uint64_t ns = stat64_get(&s->data_ns);
+    uint64_t value = 0;
+
+    if (ns) {
+        value = (double)bytes * NANOSECONDS_PER_SECOND / MiB / ns;
+    }
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void apple_aes_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
+    object_class_property_add(klass, "data-bytes", "uint64",
+                              apple_aes_get_data_bytes, NULL, NULL, NULL);
+    object_class_property_set_description(
+        klass, "data-bytes", "Bytes processed by data commands");
+    object_class_property_add(klass, "throughput", "uint64",
+                              apple_aes_get_throughput, NULL, NULL, NULL);
+    object_class_property_set_description(
+        klass, "throughput", "Data command throughput in MiB/s");
+
     dc->realize = apple_aes_realize;
     dc->unrealize = apple_aes_unrealize;
     dc->reset = apple_aes_reset;
@@ -0,0 +1,8 @@
+#include "qemu/osdep.h"
+#include "monitor/hmp.h"
+#include "monitor/monitor.h"
+
+void hmp_smc_load_keys(Monitor *mon, const QDict *qdict)
+{
+    monitor_printf(mon, "SMC is not available in this QEMU\n");
+}
@@ -3,10 +3,13 @@
 #include "hw/misc/apple-silicon/a7iop/rtbuddy.h"
 #include "hw/misc/apple-silicon/smc.h"
 #include "hw/qdev-core.h"
+#include "monitor/hmp.h"
+#include "monitor/monitor.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
 #include "qemu/bitops.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
-#include "qemu/queue.h"
 #include "sysemu/runstate.h"
 
 #define TYPE_APPLE_SMC_IOP "apple.smc"
@@ -159,7 +162,6 @@ struct smc_key {
     smc_key_info info;
     void *data;
 
-    QTAILQ_ENTRY(smc_key) entry;
     KeyReader read;
     KeyWriter write;
 };
@@ -176,33 +178,48 @@ struct AppleSMCState {
     AppleRTBuddy parent_obj;
 
     MemoryRegion *iomems[3];
-    QTAILQ_HEAD(, smc_key) keys;
-    uint32_t key_count;
+    GHashTable *key_table;
+    GPtrArray *keys; /* sorted by FourCC, for by-index lookup */
     uint64_t sram_addr;
     uint8_t sram[0x4000];
 };
 
 static smc_key *smc_get_key(AppleSMCState *s, uint32_t key)
 {
-    smc_key *d;
-    QTAILQ_FOREACH (d, &s->keys, entry) {
-        if (d->key == key) {
-            return d;
+    return g_hash_table_lookup(s->key_table, GUINT_TO_POINTER(key));
+}
+
+static smc_key *smc_get_or_add_key(AppleSMCState *s, uint32_t key)
+{
+    smc_key *k = smc_get_key(s, key);
+    guint lo = 0;
+    guint hi = s->keys->len;
+
+    if (k) {
+        return k;
+    }
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (((smc_key *)g_ptr_array_index(s->keys, mid))->key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
-    return NULL;
+
+    k = g_new0(smc_key, 1);
+    k->key = key;
+    g_ptr_array_insert(s->keys, lo, k);
+    g_hash_table_insert(s->key_table, GUINT_TO_POINTER(key), k);
+    return k;
 }
 
 static smc_key *smc_create_key(AppleSMCState *s, uint32_t key, uint32_t size,
                                uint32_t type, uint32_t attr, void *data)
 {
-    smc_key *k = smc_get_key(s, key);
-    if (!k) {
-        k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
-        s->key_count++;
-    }
-    k->key = key;
+    smc_key *k = smc_get_or_add_key(s, key);
     k->info.size = size;
     k->info.type = type;
     k->info.attr = attr;
@@ -215,13 +232,7 @@ static smc_key *smc_create_key_func(AppleSMCState *s, uint32_t key,
                                     uint32_t size, uint32_t type, uint32_t attr,
                                     KeyReader reader, KeyWriter writer)
 {
-    smc_key *k = smc_get_key(s, key);
-    if (!k) {
-        k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
-        s->key_count++;
-    }
-    k->key = key;
+    smc_key *k = smc_get_or_add_key(s, key);
     k->info.size = size;
     k->info.type = type;
     k->info.attr = attr;
@@ -234,13 +245,7 @@ static smc_key *smc_create_key_func(AppleSMCState *s, uint32_t key,
 static smc_key *smc_set_key(AppleSMCState *s, uint32_t key, uint32_t size,
                             void *data)
 {
-    smc_key *k = smc_get_key(s, key);
-    if (!k) {
-        k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
-        s->key_count++;
-    }
-    k->key = key;
+    smc_key *k = smc_get_or_add_key(s, key);
     k->info.size = size;
     k->data = g_realloc(k->data, size);
     memcpy(k->data, data, size);
@@ -277,7 +282,7 @@ static uint8_t smc_key_count_read(AppleSMCState *s, smc_key *k, void *payload,
 {
     k->info.size = 4;
     k->data = g_realloc(k->data, 4);
-    *(uint32_t *)k->data = s->key_count;
+    *(uint32_t *)k->data = s->keys->len;
     return kSMCSuccess;
 }
 
@@ -411,10 +416,10 @@ static void apple_smc_handle_key_endpoint(void *opaque, uint32_t ep,
     case SMC_GET_KEY_BY_INDEX: {
         key_response r = { 0 };
         uint32_t idx = kmsg->key;
-        smc_key *k = QTAILQ_FIRST(&s->keys);
+        smc_key *k = NULL;
 
-        for (int i = 0; i < idx && k; i++) {
-            k = QTAILQ_NEXT(k, entry);
+        if (idx < s->keys->len) {
+            k = g_ptr_array_index(s->keys, idx);
         }
 
         if (!k) {
@@ -480,6 +485,115 @@ static const MemoryRegionOps ascv2_core_reg_ops = {
     .valid.unaligned = false,
 };
 
+static bool apple_smc_parse_hex(const char *hex, uint8_t *data, size_t size)
+{
+    if (strlen(hex) != size * 2) {
+        return false;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        int hi = g_ascii_xdigit_value(hex[i * 2]);
+        int lo = g_ascii_xdigit_value(hex[i * 2 + 1]);
+
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        data[i] = (hi << 4) | lo;
+    }
+
+    return true;
+}
+
+static bool apple_smc_load_keys(AppleSMCState *s, const char *filename,
+                                Error **errp)
+{
+    g_autoptr(GKeyFile) kf = g_key_file_new();
+    g_auto(GStrv) groups = NULL;
+    GError *gerr = NULL;
+
+    if (!g_key_file_load_from_file(kf, filename, G_KEY_FILE_NONE, &gerr)) {
+        error_setg(errp, "%s: %s", filename, gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+
+    groups = g_key_file_get_groups(kf, NULL);
+    for (int i = 0; groups[i]; i++) {
+        const char *name = groups[i];
+        g_autofree char *type = NULL;
+        g_autofree char *hex = NULL;
+        g_autofree uint8_t *data = NULL;
+        char fourcc[4] = { ' ', ' ', ' ', ' ' };
+        uint64_t attr = SMC_ATTR_LITTLE_ENDIAN;
+        uint64_t size;
+
+        if (strlen(name) != 4) {
+            error_setg(errp, "%s: key '%s' is not a FourCC", filename, name);
+            return false;
+        }
+
+        type = g_key_file_get_string(kf, name, "type", NULL);
+        if (!type || !type[0] || strlen(type) > 4) {
+            error_setg(errp, "%s: key '%s' needs a type of 1-4 characters",
+                       filename, name);
+            return false;
+        }
+        memcpy(fourcc, type, strlen(type));
+
+        size = g_key_file_get_uint64(kf, name, "size", &gerr);
+        if (gerr || size == 0 || size > UINT8_MAX) {
+            error_setg(errp, "%s: key '%s' needs a size of 1-%u bytes",
+                       filename, name, UINT8_MAX);
+            g_clear_error(&gerr);
+            return false;
+        }
+
+        if (g_key_file_has_key(kf, name, "attr", NULL)) {
+            attr = g_key_file_get_uint64(kf, name, "attr", &gerr);
+            if (gerr || attr > UINT8_MAX) {
+                error_setg(errp, "%s: key '%s' has an invalid attr", filename,
+                           name);
+                g_clear_error(&gerr);
+                return false;
+            }
+        }
+
+        data = g_malloc0(size);
+        hex = g_key_file_get_string(kf, name, "data", NULL);
+        if (hex && !apple_smc_parse_hex(hex, data, size)) {
+            error_setg(errp, "%s: key '%s' data must be %" PRIu64 " hex bytes",
+                       filename, name, size);
+            return false;
+        }
+
+        smc_create_key(
+            s, SMC_MAKE_IDENTIFIER(name[0], name[1], name[2], name[3]), size,
+            SMC_MAKE_KEY_TYPE(fourcc[0], fourcc[1], fourcc[2], fourcc[3]),
+            attr, data);
+    }
+
+    return true;
+}
+
+void hmp_smc_load_keys(Monitor *mon, const QDict *qdict)
+{
+    const char *filename = qdict_get_str(qdict, "filename");
+    Object *obj = object_resolve_path_type("", TYPE_APPLE_SMC_IOP, NULL);
+    Error *err = NULL;
+
+    if (!obj) {
+        monitor_printf(mon, "No SMC in this machine\n");
+        return;
+    }
+
+    if (!apple_smc_load_keys(APPLE_SMC_IOP(obj), filename, &err)) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    monitor_printf(mon, "SMC now has %u keys\n", APPLE_SMC_IOP(obj)->keys->len);
+}
+
 SysBusDevice *apple_smc_create(DTBNode *node, AppleA7IOPVersion version,
                                uint32_t protocol_version)
 {
@@ -530,7 +644,8 @@ SysBusDevice *apple_smc_create(DTBNode *node, AppleA7IOPVersion version,
     set_dtb_prop(child, "pre-loaded", 4, (uint8_t *)&data);
     set_dtb_prop(child, "running", 4, (uint8_t *)&data);
 
-    QTAILQ_INIT(&s->keys);
+    s->key_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+    s->keys = g_ptr_array_new();
 
     return sbd;
 }
@@ -168,18 +168,19 @@ static void usb_tcp_remote_closed(USBTCPRemoteState *s)
     qemu_bh_schedule(s->cleanup_bh);
 }
 
-static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer,
-                               unsigned int length)
+static int usb_tcp_remote_readv(USBTCPRemoteState *s, struct iovec *iov,
+                                unsigned int niov)
 {
-    int ret = 0;
-    int n = 0;
+    size_t length = iov_size(iov, niov);
+    ssize_t ret = 0;
+    size_t n = 0;
     bool locked = bql_locked();
     if (locked) {
         bql_unlock();
     }
 
     while (n < length) {
-        ret = read(s->fd, (char *)buffer + n, length - n);
+        ret = iov_recv(s->fd, iov, niov, n, length - n);
         if (ret <= 0) {
             if (locked) {
                 bql_lock();
@@ -198,14 +199,23 @@ static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer,
     return n;
 }
 
-static int usb_tcp_remote_write(USBTCPRemoteState *s, void *buffer,
-                                unsigned int length)
+static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer,
+                               unsigned int length)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+
+    return usb_tcp_remote_readv(s, &iov, 1);
+}
+
+static int usb_tcp_remote_writev(USBTCPRemoteState *s, struct iovec *iov,
+                                 unsigned int niov)
 {
-    int ret = 0;
-    int n = 0;
+    size_t length = iov_size(iov, niov);
+    ssize_t ret = 0;
+    size_t n = 0;
 
     while (n < length) {
-        ret = write(s->fd, (char *)buffer + n, length - n);
+        ret = iov_send(s->fd, iov, niov, n, length - n);
         if (ret <= 0) {
             usb_tcp_remote_closed(s);
             return -errno;
@@ -217,6 +227,43 @@ static int usb_tcp_remote_write(USBTCPRemoteState *s, void *buffer,
     return n;
 }
 
+static int usb_tcp_remote_write(USBTCPRemoteState *s, void *buffer,
+                                unsigned int length)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+
+    return usb_tcp_remote_writev(s, &iov, 1);
+}
+
+/* Receive an IN payload directly into the packet's buffers. */
+static bool usb_tcp_remote_read_payload(USBTCPRemoteState *s, USBPacket *p,
+                                        uint32_t length)
+{
+    g_autofree struct iovec *iov = NULL;
+    g_autofree void *buffer = NULL;
+    unsigned int niov;
+
+    if (p && length <= p->iov.size - p->actual_length) {
+        iov = g_new(struct iovec, p->iov.niov);
+        niov = iov_copy(iov, p->iov.niov, p->iov.iov, p->iov.niov,
+                        p->actual_length, length);
+        if (usb_tcp_remote_readv(s, iov, niov) < (int)length) {
+            return false;
+        }
+        p->actual_length += length;
+        return true;
+    }
+
+    buffer = g_malloc(length);
+    if (usb_tcp_remote_read(s, buffer, length) < (int)length) {
+        return false;
+    }
+    if (p) {
+        usb_packet_copy(p, buffer, p->iov.size - p->actual_length);
+    }
+    return true;
+}
+
 static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
 {
     tcp_usb_header_t hdr = { 0 };
@@ -260,14 +307,10 @@ static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
         }
 
         if (rhdr.length > 0 && rhdr.status != USB_RET_ASYNC) {
-            g_autofree void *buffer = g_malloc(rhdr.length);
             if (rhdr.pid == USB_TOKEN_IN) {
-                if (usb_tcp_remote_read(s, buffer, rhdr.length) < rhdr.length) {
+                if (!usb_tcp_remote_read_payload(s, p, rhdr.length)) {
                     return false;
                 }
-                if (p) {
-                    usb_packet_copy(p, buffer, rhdr.length);
-                }
             } else if (p) {
                 p->actual_length += rhdr.length;
             }
@@ -323,6 +366,7 @@ static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
 
     case TCP_USB_REQUEST:
     case TCP_USB_RESET:
+    case TCP_USB_HELLO:
     default:
         DPRINTF("%s: Invalid header type: 0x%x\n", __func__, hdr.type);
         usb_tcp_remote_closed(s);
@@ -343,6 +387,38 @@ static void *usb_tcp_remote_read_thread(void *opaque)
     return NULL;
 }
 
+static bool usb_tcp_remote_check_hello(USBTCPRemoteState *s)
+{
+    tcp_usb_header_t hdr = { 0 };
+    tcp_usb_hello_header hello = { 0 };
+    struct iovec iov[] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = &hello, .iov_len = sizeof(hello) },
+    };
+    size_t length = iov_size(iov, G_N_ELEMENTS(iov));
+    size_t n = 0;
+    ssize_t ret;
+
+    while (n < length) {
+        ret = iov_recv(s->fd, iov, G_N_ELEMENTS(iov), n, length - n);
+        if (ret <= 0) {
+            return false;
+        }
+        n += ret;
+    }
+
+    if (hdr.type != TCP_USB_HELLO ||
+        hello.version != TCP_USB_PROTOCOL_VERSION) {
+        warn_report("%s: peer on %s speaks an unsupported protocol "
+                    "(type 0x%x version %u, want version %u)",
+                    TYPE_USB_TCP_REMOTE, s->socket_path, hdr.type,
+                    hello.version, TCP_USB_PROTOCOL_VERSION);
+        return false;
+    }
+
+    return true;
+}
+
 static void *usb_tcp_remote_thread(void *arg)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(arg);
@@ -359,6 +435,11 @@ static void *usb_tcp_remote_thread(void *arg)
                 DPRINTF("%s: accept error %d.\n", __func__, errno);
                 continue;
             }
+            if (!usb_tcp_remote_check_hello(s)) {
+                close(s->fd);
+                s->fd = -1;
+                continue;
+            }
             migrate_add_blocker(&s->migration_blocker, NULL);
 
             s->closed = 0;
@@ -414,20 +495,29 @@ static void usb_tcp_remote_realize(USBDevice *dev, Error **errp)
     s->fd = -1;
     s->closed = true;
 
+    if (!s->socket_path) {
+        s->socket_path = g_strdup(TCP_USB_DEFAULT_SOCKET_PATH);
+    }
+
+    if (strlen(s->socket_path) >= sizeof(ai.sun_path)) {
+        error_setg(errp, "socket path '%s' is too long", s->socket_path);
+        return;
+    }
+
     struct stat fst;
-    if (stat(socket_path, &fst) == 0) {
+    if (stat(s->socket_path, &fst) == 0) {
         if (!S_ISSOCK(fst.st_mode)) {
             qemu_log_mask(LOG_GUEST_ERROR,
                           "File '%s' already exists and is not a socket file. "
                           "Refusing to continue.",
-                          socket_path);
+                          s->socket_path);
             return;
         }
     }
 
-    if (unlink(socket_path) == -1 && errno != ENOENT) {
+    if (unlink(s->socket_path) == -1 && errno != ENOENT) {
         qemu_log_mask(LOG_GUEST_ERROR, "%s: unlink(%s) failed: %s", __func__,
-                      socket_path, strerror(errno));
+                      s->socket_path, strerror(errno));
         return;
     }
 
@@ -438,14 +528,14 @@ static void usb_tcp_remote_realize(USBDevice *dev, Error **errp)
     }
 
     ai.sun_family = AF_UNIX;
-    strncpy(ai.sun_path, socket_path, sizeof(ai.sun_path));
+    strncpy(ai.sun_path, s->socket_path, sizeof(ai.sun_path));
     ai.sun_path[sizeof(ai.sun_path) - 1] = '\0';
 
     if (bind(s->socket, (struct sockaddr *)&ai, sizeof(ai)) < 0) {
         error_setg(errp, "Cannot bind socket");
         return;
     }
-    chmod(socket_path, 0666);
+    chmod(s->socket_path, 0666);
 
     if (listen(s->socket, 5) < 0) {
         error_setg(errp, "Cannot listen on socket");
@@ -542,8 +632,12 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
 
     WITH_QEMU_LOCK_GUARD(&s->request_mutex)
     {
-        usb_tcp_remote_write(s, &hdr, sizeof(hdr));
-        usb_tcp_remote_write(s, &pkt, sizeof(pkt));
+        struct iovec iov[] = {
+            { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+            { .iov_base = &pkt, .iov_len = sizeof(pkt) },
+        };
+
+        usb_tcp_remote_writev(s, iov, G_N_ELEMENTS(iov));
     }
     /* TODO: wait for status */
 
@@ -575,7 +669,9 @@ static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
     tcp_usb_header_t hdr = { 0 };
     tcp_usb_request_header pkt = { 0 };
     USBTCPInflightPacket inflightPacket = { 0 };
-    g_autofree void *buffer = NULL;
+    g_autofree struct iovec *iov = NULL;
+    unsigned int niov = 2;
+    size_t length;
     bool locked = bql_locked();
 
     if (s->closed) {
@@ -596,23 +692,35 @@ static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
     DPRINTF("%s: pid: 0x%x ep 0x%x id 0x%llx len 0x%x\n", __func__, pkt.pid,
             pkt.ep, pkt.id, pkt.length);
 
+    /*
+     * Send header, request and OUT payload in a single vectored write,
+     * straight out of the packet's own buffers.
+     */
+    iov = g_new(struct iovec, 2 + p->iov.niov);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = &pkt;
+    iov[1].iov_len = sizeof(pkt);
+
     if (p->pid != USB_TOKEN_IN && pkt.length) {
-        buffer = g_malloc0(pkt.length);
-        usb_packet_copy(p, buffer, pkt.length);
-        p->actual_length -= pkt.length;
-        if (p->pid == USB_TOKEN_SETUP && p->ep->nr == 0 && buffer) {
-            struct usb_control_packet *setup =
-                (struct usb_control_packet *)buffer;
+        niov += iov_copy(iov + 2, p->iov.niov, p->iov.iov, p->iov.niov,
+                         p->actual_length, pkt.length);
+        if (p->pid == USB_TOKEN_SETUP && p->ep->nr == 0) {
+            struct usb_control_packet setup = { 0 };
+
+            iov_to_buf(p->iov.iov, p->iov.niov, p->actual_length, &setup,
+                       sizeof(setup));
 #ifdef DEBUG_DEV_TCP_REMOTE
-            qemu_hexdump(stderr, __func__, buffer, pkt.length);
+            qemu_hexdump(stderr, __func__, &setup, sizeof(setup));
 #endif
 
-            if (setup->bmRequestType == 0 &&
-                setup->bRequest == USB_REQ_SET_ADDRESS) {
-                s->addr = setup->wValue;
+            if (setup.bmRequestType == 0 &&
+                setup.bRequest == USB_REQ_SET_ADDRESS) {
+                s->addr = setup.wValue;
             }
         }
     }
+    length = iov_size(iov, niov);
 
     inflightPacket.p = p;
     inflightPacket.addr = dev->addr;
@@ -627,22 +735,10 @@ static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
 
     WITH_QEMU_LOCK_GUARD(&s->request_mutex)
     {
-        if (usb_tcp_remote_write(s, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-            p->status = USB_RET_STALL;
-            goto out;
-        }
-
-        if (usb_tcp_remote_write(s, &pkt, sizeof(pkt)) < sizeof(pkt)) {
+        if (usb_tcp_remote_writev(s, iov, niov) < (int)length) {
             p->status = USB_RET_STALL;
             goto out;
         }
-
-        if (buffer) {
-            if (usb_tcp_remote_write(s, buffer, pkt.length) < pkt.length) {
-                p->status = USB_RET_STALL;
-                goto out;
-            }
-        }
     }
 
     if (locked) {
@@ -670,6 +766,7 @@ out:
 }
 
 static Property usb_tcp_remote_properties[] = {
+    DEFINE_PROP_STRING("socket", USBTCPRemoteState, socket_path),
     DEFINE_PROP_END_OF_LIST(),
 };
 
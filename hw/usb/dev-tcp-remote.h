@@ -42,6 +42,7 @@ typedef struct USBTCPRemoteState {
     QEMUBH *cleanup_bh;
     Error *migration_blocker;
 
+    char *socket_path;
     int socket;
     int fd;
     uint8_t addr;
@@ -69,9 +69,9 @@ static ssize_t tcp_usb_read(QIOChannel *ioc, void *buf, size_t len)
     return (ret <= 0) ? ret : iov.iov_len;
 }
 
-static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
+static bool tcp_usb_writev(QIOChannel *ioc, const struct iovec *iov,
+                           size_t niov)
 {
-    struct iovec iov = { .iov_base = buf, .iov_len = len };
     bool iolock = bql_locked();
     bool iothread = qemu_in_iothread();
     bool ret = false;
@@ -87,7 +87,7 @@ static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
         bql_unlock();
     }
 
-    if (!qio_channel_writev_full_all(ioc, &iov, 1, NULL, 0, 0, &err)) {
+    if (!qio_channel_writev_full_all(ioc, iov, niov, NULL, 0, 0, &err)) {
         ret = true;
     }
 
@@ -118,7 +118,8 @@ static void coroutine_fn usb_tcp_host_respond_packet_co(void *opaque)
     USBPacket *p = &pkt->p;
     tcp_usb_header_t hdr = { 0 };
     tcp_usb_response_header resp = { 0 };
-    g_autofree void *buffer = NULL;
+    g_autofree struct iovec *iov = NULL;
+    size_t niov = 2;
     USBPort *uport = usb_tcp_host_find_active_port(s);
 
     WITH_QEMU_LOCK_GUARD(&s->write_mutex)
@@ -136,27 +137,25 @@ static void coroutine_fn usb_tcp_host_respond_packet_co(void *opaque)
                 resp.length = p->actual_length;
             }
 
-            if (p->pid == USB_TOKEN_IN && p->status != USB_RET_ASYNC) {
-                buffer = g_malloc(resp.length);
-                iov_to_buf(p->iov.iov, p->iov.niov, 0, buffer, resp.length);
-            }
+            /*
+             * Send header, response and payload in a single vectored write,
+             * straight out of the packet's own buffers.
+             */
+            iov = g_new(struct iovec, 2 + p->iov.niov);
+            iov[0].iov_base = &hdr;
+            iov[0].iov_len = sizeof(hdr);
+            iov[1].iov_base = &resp;
+            iov[1].iov_len = sizeof(resp);
 
-            if (!tcp_usb_write(s->ioc, &hdr, sizeof(hdr))) {
-                usb_tcp_host_closed(s);
-                return;
+            if (p->pid == USB_TOKEN_IN && p->status != USB_RET_ASYNC) {
+                niov += iov_copy(iov + 2, p->iov.niov, p->iov.iov, p->iov.niov,
+                                 0, resp.length);
             }
 
-            if (!tcp_usb_write(s->ioc, &resp, sizeof(resp))) {
+            if (!tcp_usb_writev(s->ioc, iov, niov)) {
                 usb_tcp_host_closed(s);
                 return;
             }
-
-            if (buffer) {
-                if (!tcp_usb_write(s->ioc, buffer, resp.length)) {
-                    usb_tcp_host_closed(s);
-                    return;
-                }
-            }
         }
     }
 
@@ -220,7 +219,7 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
                              pkt_hdr.id, pkt_hdr.short_not_ok, pkt_hdr.int_req);
 
             if (pkt_hdr.length > 0) {
-                buffer = g_malloc0(pkt_hdr.length);
+                buffer = g_malloc(pkt_hdr.length);
 
                 if (pkt_hdr.pid != USB_TOKEN_IN) {
                     if (unlikely(tcp_usb_read(s->ioc, buffer, pkt_hdr.length) !=
@@ -323,6 +322,18 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
     return;
 }
 
+static bool usb_tcp_host_send_hello(QIOChannel *ioc)
+{
+    tcp_usb_header_t hdr = { .type = TCP_USB_HELLO };
+    tcp_usb_hello_header hello = { .version = TCP_USB_PROTOCOL_VERSION };
+    struct iovec iov[] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = &hello, .iov_len = sizeof(hello) },
+    };
+
+    return tcp_usb_writev(ioc, iov, G_N_ELEMENTS(iov));
+}
+
 static void usb_tcp_host_attach(USBPort *uport)
 {
     struct sockaddr_un server_addr;
@@ -351,13 +362,15 @@ static void usb_tcp_host_attach(USBPort *uport)
 
     sock = socket(AF_UNIX, SOCK_STREAM, 0);
 
-    if (socket < 0) {
+    if (sock < 0) {
         error_report("%s: cannot open socket", __func__);
+        return;
     }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sun_family = AF_UNIX;
-    strncpy(server_addr.sun_path, socket_path, sizeof(server_addr.sun_path));
+    strncpy(server_addr.sun_path, s->socket_path,
+            sizeof(server_addr.sun_path));
     server_addr.sun_path[sizeof(server_addr.sun_path) - 1] = '\0';
 
     ret = connect(sock, (const struct sockaddr *)&server_addr,
@@ -374,6 +387,14 @@ static void usb_tcp_host_attach(USBPort *uport)
         close(sock);
         return;
     }
+
+    if (!usb_tcp_host_send_hello(ioc)) {
+        error_report("%s: failed to send protocol version to %s", __func__,
+                     s->socket_path);
+        object_unref(OBJECT(ioc));
+        return;
+    }
+
     object_ref(ioc);
     qio_channel_set_blocking(ioc, false, NULL);
     s->closed = false;
@@ -411,6 +432,16 @@ static void usb_tcp_host_realize(DeviceState *dev, Error **errp)
 {
     USBTCPHostState *s = USB_TCP_HOST(dev);
 
+    if (!s->socket_path) {
+        s->socket_path = g_strdup(TCP_USB_DEFAULT_SOCKET_PATH);
+    }
+
+    if (strlen(s->socket_path) >=
+        sizeof(((struct sockaddr_un *)NULL)->sun_path)) {
+        error_setg(errp, "socket path '%s' is too long", s->socket_path);
+        return;
+    }
+
     usb_bus_new(&s->bus, sizeof(s->bus), &usb_tcp_bus_ops, dev);
     for (int i = 0; i < G_N_ELEMENTS(s->uports); i++) {
         usb_register_port(&s->bus, &s->uports[i], s, i, &usb_tcp_host_port_ops,
@@ -447,6 +478,7 @@ static void usb_tcp_host_init(Object *obj)
 }
 
 static Property usb_tcp_host_properties[] = {
+    DEFINE_PROP_STRING("socket", USBTCPHostState, socket_path),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -4,13 +4,20 @@
 #include "qemu/osdep.h"
 #include "hw/usb.h"
 
-static const char *socket_path = "/tmp/usbqemu";
+#define TCP_USB_DEFAULT_SOCKET_PATH "/tmp/usbqemu"
+
+/*
+ * Version 2 widens the payload lengths to 32 bits and starts every
+ * connection with a TCP_USB_HELLO from the host side.
+ */
+#define TCP_USB_PROTOCOL_VERSION 2
 
 enum {
     TCP_USB_REQUEST  = (1 << 0),
     TCP_USB_RESPONSE = (1 << 1),
     TCP_USB_RESET    = (1 << 2),
-    TCP_USB_CANCEL   = (1 << 3)
+    TCP_USB_CANCEL   = (1 << 3),
+    TCP_USB_HELLO    = (1 << 4),
 };
 
 typedef struct QEMU_PACKED tcp_usb_header {
@@ -25,7 +32,7 @@ typedef struct QEMU_PACKED tcp_usb_request_header {
     uint64_t id;
     uint8_t short_not_ok;
     uint8_t int_req;
-    uint16_t length;
+    uint32_t length;
 } tcp_usb_request_header;
 
 typedef struct QEMU_PACKED tcp_usb_response_header {
@@ -34,7 +41,7 @@ typedef struct QEMU_PACKED tcp_usb_response_header {
     uint8_t ep;
     uint64_t id;
     uint32_t status;
-    uint16_t length;
+    uint32_t length;
 } tcp_usb_response_header;
 
 typedef struct QEMU_PACKED tcp_usb_cancel_header {
@@ -45,4 +52,8 @@ typedef struct QEMU_PACKED tcp_usb_cancel_header {
 
 } tcp_usb_cancel_header;
 
+typedef struct QEMU_PACKED tcp_usb_hello_header {
+    uint32_t version;
+} tcp_usb_hello_header;
+
 #endif //HW_USB_TCP_USB_H
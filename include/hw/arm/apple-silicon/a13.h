@@ -26,6 +26,7 @@
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/cpu/cluster.h"
 #include "qemu/queue.h"
+#include "qemu/timer.h"
 #include "cpu.h"
 
 #define A13_MAX_CPU 6
@@ -70,6 +71,8 @@ typedef struct AppleA13State {
     uint64_t ipi_sr;
     hwaddr cluster_reg[2];
     qemu_irq fast_ipi;
+    uint64_t gl_rate_count;
+    int64_t gl_rate_ns;
     A13_CPREG_VAR_DEF(ARM64_REG_EHID3);
     A13_CPREG_VAR_DEF(ARM64_REG_EHID4);
     A13_CPREG_VAR_DEF(ARM64_REG_EHID10);
@@ -115,6 +118,8 @@ typedef struct AppleA13Cluster {
     AppleA13State *cpus[A13_MAX_CPU];
     uint32_t deferredIPI[A13_MAX_CPU][A13_MAX_CPU];
     uint32_t noWakeIPI[A13_MAX_CPU][A13_MAX_CPU];
+    int64_t ipi_deadline[A13_MAX_CPU][A13_MAX_CPU];
+    QEMUTimer *ipi_timer;
     uint64_t tick;
     uint64_t ipi_cr;
     QTAILQ_ENTRY(AppleA13Cluster) next;
@@ -283,7 +283,7 @@ typedef struct {
     uint8_t boot_nonce_hash[XNU_BNCH_SIZE];
 } AppleBootInfo;
 
-MachoHeader64 *macho_load_file(const char *filename,
+MachoHeader64 *macho_load_file(const char *filename, const char *cache_dir,
                                MachoHeader64 **secure_monitor);
 
 MachoHeader64 *macho_parse(uint8_t *data, uint32_t len);
@@ -342,18 +342,20 @@ void macho_load_raw_file(const char *filename, AddressSpace *as,
                          MemoryRegion *mem, const char *name, hwaddr file_pa,
                          uint64_t *size);
 
-DTBNode *load_dtb_from_file(char *filename);
+DTBNode *load_dtb_from_file(char *filename, const char *cache_dir);
 
 void macho_populate_dtb(DTBNode *root, AppleBootInfo *info);
 
 void macho_load_dtb(DTBNode *root, AddressSpace *as, MemoryRegion *mem,
                     const char *name, AppleBootInfo *info);
 
-uint8_t *load_trustcache_from_file(const char *filename, uint64_t *size);
+uint8_t *load_trustcache_from_file(const char *filename,
+                                   const char *cache_dir, uint64_t *size);
 void macho_load_trustcache(void *trustcache, uint64_t size, AddressSpace *as,
                            MemoryRegion *mem, hwaddr pa);
 
-void macho_load_ramdisk(const char *filename, AddressSpace *as,
-                        MemoryRegion *mem, hwaddr pa, uint64_t *size);
+void macho_load_ramdisk(const char *filename, const char *cache_dir,
+                        AddressSpace *as, MemoryRegion *mem, hwaddr pa,
+                        MemoryRegion **ramdisk_mr, uint64_t *size);
 
 #endif /* HW_ARM_APPLE_SILICON_BOOT_H */
@@ -39,11 +39,17 @@ typedef struct {
     uint8_t *value;
 } DTBProp;
 
-typedef struct {
+typedef struct DTBNode {
     uint32_t prop_count;
     uint32_t child_node_count;
     GList *props;
     GList *child_nodes;
+    struct DTBNode *parent;
+    // Lookup indexes, built on first use and dropped when they go stale.
+    GHashTable *prop_index;
+    GHashTable *child_index;
+    // Serialized size of this subtree, 0 when it needs recomputing.
+    uint64_t buffer_size;
 } DTBNode;
 
 DTBNode *load_dtb(uint8_t *dtb_blob);
@@ -66,6 +66,8 @@ typedef struct {
     AppleBootInfo bootinfo;
     AppleVideoArgs video;
     char *trustcache_filename;
+    char *payload_cache;
+    MemoryRegion *ramdisk_mr;
     char *ticket_filename;
     char *seprom_filename;
     char *sep_fw_filename;
@@ -24,6 +24,8 @@
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/misc/apple-silicon/a7iop/core.h"
 #include "hw/sysbus.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "qemu/typedefs.h"
 #include "qom/object.h"
 
@@ -52,19 +54,41 @@ typedef struct {
     uint32_t in_size;
     uint64_t out_addr;
     uint32_t out_size;
+    // Scratch buffer reused by every reply on this endpoint.
+    uint8_t *out_buf;
+    uint32_t out_buf_size;
 } AppleSEPSimOOLState;
 
+// Power-of-two microsecond buckets, the last one catching everything above.
+#define SEP_SIM_LATENCY_BUCKETS 16
+
+typedef struct AppleSEPSimRequest AppleSEPSimRequest;
+typedef struct AppleSEPSimWrite AppleSEPSimWrite;
+
 struct AppleSEPSimState {
     /*< private >*/
     AppleA7IOP parent_obj;
 
     MemoryRegion *dma_mr;
     AddressSpace *dma_as;
+    // Held by the worker while it runs a handler; guards everything below.
     QemuMutex lock;
     bool rsep;
     uint32_t status;
     AppleSEPSimOOLInfo ool_info[SEP_ENDPOINT_MAX];
     AppleSEPSimOOLState ool_state[SEP_ENDPOINT_MAX];
+    uint64_t latency_hist[UINT8_MAX + 1][SEP_SIM_LATENCY_BUCKETS];
+
+    // Requests from the mailbox BH to the worker, replies and OOL writes
+    // back to the BQL. The worker itself never touches guest memory.
+    QemuThread thread;
+    QemuCond thread_cond;
+    QemuMutex queue_mutex;
+    QTAILQ_HEAD(, AppleSEPSimRequest) queue;
+    QTAILQ_HEAD(, AppleSEPSimWrite) writes;
+    QTAILQ_HEAD(, AppleA7IOPMessage) replies;
+    QEMUBH *reply_bh;
+    bool stopped;
 };
 
 AppleSEPSimState *apple_sep_sim_create(DTBNode *node, bool modern);
@@ -31,10 +31,19 @@
 #define TYPE_APPLE_SEP "apple-sep"
 OBJECT_DECLARE_TYPE(AppleSEPState, AppleSEPClass, APPLE_SEP)
 
+#define TRNG_POOL_SIZE (0x1000)
+
 typedef struct {
     uint8_t key[32];
     uint64_t ecid;
     uint32_t config;
+    // Output is served from a pool refilled in bulk, either from the host
+    // RNG or, when `deterministic` is set, from a PRNG seeded with `seed`.
+    uint8_t pool[TRNG_POOL_SIZE];
+    uint32_t pool_pos;
+    bool deterministic;
+    uint64_t seed;
+    uint64_t prng_state;
 } AppleTRNGState;
 
 #define REG_SIZE (0x10000)
@@ -60,9 +60,13 @@ typedef struct {
     MachoHeader64 *kernel;
     DTBNode *device_tree;
     uint8_t *trustcache;
+    GBytes *seprom;
+    GBytes *sep_fw;
     AppleBootInfo bootinfo;
     AppleVideoArgs video_args;
     char *trustcache_filename;
+    char *payload_cache;
+    MemoryRegion *ramdisk_mr;
     char *ticket_filename;
     char *seprom_filename;
     char *sep_fw_filename;
@@ -78,6 +82,8 @@ typedef struct {
     uint8_t amcc_reg[0x100000];
     bool kaslr_off;
     bool force_dfu;
+    bool trng_seed_set;
+    uint64_t trng_seed;
 } T8030MachineState;
 
 #endif /* HW_ARM_APPLE_SILICON_T8030_H */
@@ -33,6 +33,8 @@ typedef struct {
     uint32_t end;
     uint32_t stride;
     uint32_t size;
+    uint8_t *buf;
+    size_t buf_size;
 } GenPipeLayer;
 
 typedef struct {
@@ -44,9 +46,11 @@ typedef struct {
     AppleDisplayPipeV2State *disp_state;
     uint32_t config_control;
     uint32_t pixel_format;
+    uint32_t status;
     uint16_t width;
     uint16_t height;
     GenPipeLayer layers[2];
+    uint8_t *composite;
 } GenPipeState;
 
 struct AppleDisplayPipeV2State {
@@ -58,11 +62,11 @@ struct AppleDisplayPipeV2State {
     MemoryRegion up_regs, vram;
     MemoryRegion *dma_mr;
     AddressSpace dma_as;
-    MemoryRegionSection vram_section;
     qemu_irq irqs[9];
     uint32_t int_filter;
     GenPipeState genpipes[2];
     QemuConsole *console;
+    bool invalidate;
 };
 
 AppleDisplayPipeV2State *apple_displaypipe_v2_create(MachineState *machine,
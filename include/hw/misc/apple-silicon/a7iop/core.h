@@ -32,9 +32,12 @@ struct AppleA7IOP {
     uint32_t cpu_ctrl;
 };
 
-void apple_a7iop_send_ap(AppleA7IOP *s, AppleA7IOPMessage *msg);
+extern const VMStateDescription vmstate_apple_a7iop;
+
+bool apple_a7iop_send_ap(AppleA7IOP *s, AppleA7IOPMessage *msg);
+void apple_a7iop_set_ap_drain_bh(AppleA7IOP *s, QEMUBH *bh);
 AppleA7IOPMessage *apple_a7iop_recv_ap(AppleA7IOP *s);
-void apple_a7iop_send_iop(AppleA7IOP *s, AppleA7IOPMessage *msg);
+bool apple_a7iop_send_iop(AppleA7IOP *s, AppleA7IOPMessage *msg);
 AppleA7IOPMessage *apple_a7iop_recv_iop(AppleA7IOP *s);
 void apple_a7iop_cpu_start(AppleA7IOP *s, bool wake);
 uint32_t apple_a7iop_get_cpu_status(AppleA7IOP *s);
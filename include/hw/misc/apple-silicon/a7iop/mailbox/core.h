@@ -7,6 +7,9 @@
 #include "qemu/queue.h"
 
 #define TYPE_APPLE_A7IOP_MAILBOX "apple-a7iop-mailbox"
+
+/* Power of two large enough for the 15-entry hardware FIFO */
+#define APPLE_A7IOP_MAILBOX_RING_SIZE 16
 OBJECT_DECLARE_SIMPLE_TYPE(AppleA7IOPMailbox, APPLE_A7IOP_MAILBOX)
 
 typedef struct AppleA7IOPMessage {
@@ -29,14 +32,18 @@ struct AppleA7IOPMailbox {
     QemuMutex lock;
     MemoryRegion mmio;
     QEMUBH *bh;
-    QTAILQ_HEAD(, AppleA7IOPMessage) inbox;
-    size_t count;
+    /* Producer retry hook, scheduled whenever a message is popped. */
+    QEMUBH *drain_bh;
+    AppleA7IOPMessage ring[APPLE_A7IOP_MAILBOX_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
     AppleA7IOPMailbox *iop_mailbox;
     AppleA7IOPMailbox *ap_mailbox;
     qemu_irq irqs[APPLE_A7IOP_IRQ_MAX];
     bool iop_dir_en;
     bool ap_dir_en;
     bool underflow;
+    bool overflow;
     uint32_t int_mask;
     uint8_t iop_recv_reg[16];
     uint8_t ap_recv_reg[16];
@@ -44,9 +51,11 @@ struct AppleA7IOPMailbox {
     uint8_t ap_send_reg[16];
 };
 
+extern const VMStateDescription vmstate_apple_a7iop_message;
+
 bool apple_a7iop_mailbox_is_empty(AppleA7IOPMailbox *s);
-void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
-void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
+bool apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
+bool apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
 AppleA7IOPMessage *apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s);
 AppleA7IOPMessage *apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s);
 AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
@@ -92,10 +92,14 @@ struct AppleRTBuddy {
     const AppleRTBuddyOps *ops;
     QemuMutex lock;
     void *opaque;
-    AppleRTBuddyEP0State ep0_status;
+    uint32_t ep0_status; /* AppleRTBuddyEP0State */
     uint32_t protocol_version;
     GTree *endpoints;
     QTAILQ_HEAD(, AppleA7IOPMessage) rollcall;
+    /* Messages waiting for room in the AP-bound ring. */
+    QemuMutex outbox_lock;
+    QEMUBH *outbox_bh;
+    QTAILQ_HEAD(, AppleA7IOPMessage) outbox;
 };
 
 void apple_rtbuddy_send_control_msg(AppleRTBuddy *s, uint32_t ep,
@@ -27,6 +27,7 @@ struct USBTCPHostState {
     QIOChannel *ioc;
     CoMutex write_mutex;
     Error *migration_blocker;
+    char *socket_path;
     bool closed;
     bool stopped;
 };
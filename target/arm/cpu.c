@@ -160,6 +160,12 @@ void arm_register_el_change_hook(ARMCPU *cpu, ARMELChangeHookFn *hook,
     QLIST_INSERT_HEAD(&cpu->el_change_hooks, entry, node);
 }
 
+void arm_set_wfe_event_hook(ARMCPU *cpu, ARMWFEEventFn *hook, void *opaque)
+{
+    cpu->wfe_event_hook = hook;
+    cpu->wfe_event_opaque = opaque;
+}
+
 static void cp_reg_reset(gpointer key, gpointer value, gpointer opaque)
 {
     /* Reset a single ARMCPRegInfo register */
@@ -1764,6 +1770,9 @@ static void arm_cpu_finalizefn(Object *obj)
     if (cpu->pmu_timer) {
         timer_free(cpu->pmu_timer);
     }
+    if (cpu->wfe_timer) {
+        timer_free(cpu->wfe_timer);
+    }
 #endif
 }
 
@@ -1916,6 +1925,14 @@ static void arm_cpu_realizefn(DeviceState *dev, Error **errp)
         cpu->gt_timer[GTIMER_HYPVIRT] = timer_new(QEMU_CLOCK_VIRTUAL, scale,
                                                   arm_gt_hvtimer_cb, cpu);
     }
+
+    if (arm_feature(env, ARM_FEATURE_WFE_HALT)) {
+        if (!cpu->wfe_timeout_ns) {
+            cpu->wfe_timeout_ns = SCALE_MS;
+        }
+        cpu->wfe_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, arm_wfe_timer_cb,
+                                      cpu);
+    }
 #endif
 
     cpu_exec_realizefn(cs, &local_err);
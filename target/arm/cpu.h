@@ -574,6 +574,15 @@ typedef struct CPUArchState {
         uint64_t esr_gl[4];
         uint64_t elr_gl[4];
         uint64_t far_gl[4];
+        /*
+         * TB flags of the side of a GL transition that is not live,
+         * indexed by guarded state and tagged with the EL and PSTATE bits
+         * they were computed for. Dropped on every full hflags rebuild.
+         */
+        CPUARMTBFlags hflags[2];
+        uint32_t hflags_key[2];
+        bool hflags_valid[2];
+        uint64_t gl_transitions;
     } gxf;
 
     struct {
@@ -728,6 +737,12 @@ typedef struct CPUArchState {
      */
     uint64_t exclusive_high;
 
+    /*
+     * Event register, set by SEV/SEVL and consumed by WFE. Only modelled
+     * for CPUs with ARM_FEATURE_WFE_HALT.
+     */
+    uint32_t event_register;
+
     /* iwMMXt coprocessor state.  */
     struct {
         uint64_t regs[16];
@@ -857,6 +872,13 @@ struct ARMELChangeHook {
     QLIST_ENTRY(ARMELChangeHook) node;
 };
 
+/**
+ * ARMWFEEventFn:
+ * type of a function which can be registered via arm_set_wfe_event_hook()
+ * to report WFE wake-up events that are not interrupts.
+ */
+typedef bool ARMWFEEventFn(ARMCPU *cpu, void *opaque);
+
 /* These values map onto the return values for
  * QEMU_PSCI_0_2_FN_AFFINITY_INFO */
 typedef enum ARMPSCIState {
@@ -1155,6 +1177,18 @@ struct ArchCPU {
     /* Apple PAC boot diversifier */
     uint64_t m_key_lo;
     uint64_t m_key_hi;
+
+    /*
+     * ARM_FEATURE_WFE_HALT: the exclusive monitor does not generate
+     * events, so a CPU halted in WFE is also woken every wfe_timeout_ns,
+     * like the generic timer event stream would. wfe_event_hook reports
+     * device events that do not raise an unmasked interrupt.
+     */
+    QEMUTimer *wfe_timer;
+    uint64_t wfe_timeout_ns;
+    uint64_t wfe_halts;
+    ARMWFEEventFn *wfe_event_hook;
+    void *wfe_event_opaque;
 };
 
 typedef struct ARMCPUInfo {
@@ -1188,6 +1222,7 @@ void arm_gt_vtimer_cb(void *opaque);
 void arm_gt_htimer_cb(void *opaque);
 void arm_gt_stimer_cb(void *opaque);
 void arm_gt_hvtimer_cb(void *opaque);
+void arm_wfe_timer_cb(void *opaque);
 
 unsigned int gt_cntfrq_period_ns(ARMCPU *cpu);
 void gt_rme_post_el_change(ARMCPU *cpu, void *opaque);
@@ -2433,6 +2468,7 @@ enum arm_features {
     ARM_FEATURE_M_MAIN, /* M profile Main Extension */
     ARM_FEATURE_V8_1M, /* M profile extras only in v8.1M and later */
     ARM_FEATURE_GXF, /* has Apple's GXF support */
+    ARM_FEATURE_WFE_HALT, /* WFE halts until an interrupt or wfe_timer */
 };
 
 static inline int arm_feature(CPUARMState *env, int feature)
@@ -3314,6 +3350,15 @@ void arm_register_pre_el_change_hook(ARMCPU *cpu, ARMELChangeHookFn *hook,
 void arm_register_el_change_hook(ARMCPU *cpu, ARMELChangeHookFn *hook, void
         *opaque);
 
+/**
+ * arm_set_wfe_event_hook:
+ * Set a hook function which WFE calls on ARM_FEATURE_WFE_HALT CPUs before
+ * halting. If it returns true, an event the device model cannot raise as
+ * an interrupt (for example a mailbox message with its IRQ masked) is
+ * pending, and WFE returns instead of halting.
+ */
+void arm_set_wfe_event_hook(ARMCPU *cpu, ARMWFEEventFn *hook, void *opaque);
+
 /**
  * arm_rebuild_hflags:
  * Rebuild the cached TBFLAGS for arbitrary changed processor state.
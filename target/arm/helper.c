@@ -3228,6 +3228,14 @@ void arm_gt_hvtimer_cb(void *opaque)
     gt_recalc_timer(cpu, GTIMER_HYPVIRT);
 }
 
+void arm_wfe_timer_cb(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+
+    /* Any pending interrupt request is enough to leave the WFE halt */
+    cpu_interrupt(CPU(cpu), CPU_INTERRUPT_EXITTB);
+}
+
 static void arm_gt_cntfrq_reset(CPUARMState *env, const ARMCPRegInfo *opaque)
 {
     ARMCPU *cpu = env_archcpu(env);
@@ -11590,6 +11598,11 @@ static void arm_cpu_do_interrupt_aarch64(CPUState *cs)
         addr = env->gxf.vbar_gl[new_el];
     }
 
+    if (tcg_enabled() && (cs->exception_index == EXCP_GENTER ||
+                          cs->exception_index == EXCP_GXF_ABORT)) {
+        arm_gxf_hflags_save(env);
+    }
+
     if (tcg_enabled()) {
         /*
          * Note that new_el can never be 0.  If cur_el is 0, then
@@ -11825,8 +11838,16 @@ static void arm_cpu_do_interrupt_aarch64(CPUState *cs)
     env->aarch64 = true;
     aarch64_restore_sp(env, new_el);
 
+    if (genter) {
+        env->gxf.gl_transitions++;
+    }
+
     if (tcg_enabled()) {
-        helper_rebuild_hflags_a64(env, new_el);
+        if (genter) {
+            arm_gxf_hflags_switch(env, new_el);
+        } else {
+            helper_rebuild_hflags_a64(env, new_el);
+        }
     }
 
     env->pc = addr;
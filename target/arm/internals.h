@@ -400,6 +400,14 @@ static inline void aarch64_restore_sp(CPUARMState *env, int el)
     }
 }
 
+/*
+ * Cache the current TB flags before a GL transition, then switch to the
+ * flags of the other side at @el, rebuilding them only if they are not
+ * cached.
+ */
+void arm_gxf_hflags_save(CPUARMState *env);
+void arm_gxf_hflags_switch(CPUARMState *env, int el);
+
 static inline void update_spsel(CPUARMState *env, uint32_t imm)
 {
     unsigned int cur_el = arm_current_el(env);
@@ -957,6 +965,48 @@ static inline bool regime_is_user(CPUARMState *env, ARMMMUIdx mmu_idx)
     }
 }
 
+/*
+ * Translate a 4-bit SPRR permission attribute to page R/W/X protection
+ * flags, as seen from GXF (@guarded) or from the normal world.
+ */
+static inline int arm_sprr_attr_to_prot(int attr, bool guarded)
+{
+    if (guarded) {
+        switch (attr >> 2) {
+        case 0:
+            return 0;
+        case 1:
+            return PAGE_READ | PAGE_EXEC;
+        case 2:
+            return PAGE_READ;
+        case 3:
+            return PAGE_READ | PAGE_WRITE;
+        default:
+            g_assert_not_reached();
+        }
+    }
+
+    switch (attr & 3) {
+    case 0:
+        return 0;
+    case 1:
+        if ((attr >> 2) == 2) {
+            return PAGE_EXEC;
+        }
+        return PAGE_READ | PAGE_EXEC;
+    case 2:
+        return PAGE_READ;
+    case 3:
+        if ((attr >> 2) == 1) {
+            /* No R/W in EL if RX in GXF */
+            return 0;
+        }
+        return PAGE_READ | PAGE_WRITE;
+    default:
+        g_assert_not_reached();
+    }
+}
+
 /* Return the SCTLR value which controls this address translation regime */
 static inline uint64_t regime_sctlr(CPUARMState *env, ARMMMUIdx mmu_idx)
 {
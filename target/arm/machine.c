@@ -242,6 +242,64 @@ static const VMStateDescription vmstate_irq_line_state = {
     }
 };
 
+static bool gxf_needed(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+    CPUARMState *env = &cpu->env;
+
+    return arm_feature(env, ARM_FEATURE_GXF);
+}
+
+/*
+ * Apple GXF and SPRR state. Only the EL1 registers are exposed as cpregs,
+ * and the banked GL ones only through whichever copy is live, so migrate
+ * the whole blocks here.
+ */
+static const VMStateDescription vmstate_gxf = {
+    .name = "cpu/gxf",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = gxf_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT64_ARRAY(env.gxf.gxf_config_el, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.gxf_enter_el, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.gxf_status_el, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.gxf_abort_el, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.sp_gl, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.tpidr_gl, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.vbar_gl, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.spsr_gl, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.aspsr_gl, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.esr_gl, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.elr_gl, ARMCPU, 4),
+        VMSTATE_UINT64_ARRAY(env.gxf.far_gl, ARMCPU, 4),
+        VMSTATE_UINT64_2DARRAY(env.sprr.sprr_el_br_el1, ARMCPU, 4, 2),
+        VMSTATE_UINT64_ARRAY(env.sprr.sprr_config_el, ARMCPU, 4),
+        VMSTATE_UINT64_2DARRAY(env.sprr.mprr_el_br_el1, ARMCPU, 4, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool wfe_halt_needed(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+    CPUARMState *env = &cpu->env;
+
+    return arm_feature(env, ARM_FEATURE_WFE_HALT);
+}
+
+static const VMStateDescription vmstate_wfe_halt = {
+    .name = "cpu/wfe_halt",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = wfe_halt_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(env.event_register, ARMCPU),
+        VMSTATE_TIMER_PTR(wfe_timer, ARMCPU),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static bool m_needed(void *opaque)
 {
     ARMCPU *cpu = opaque;
@@ -957,6 +1015,8 @@ const VMStateDescription vmstate_arm_cpu = {
 #endif
         &vmstate_serror,
         &vmstate_irq_line_state,
+        &vmstate_gxf,
+        &vmstate_wfe_halt,
         NULL
     }
 };
@@ -1,5 +1,9 @@
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
 #include "WKdm_internal.h"
 
+/* The packers are plain indexed loops so the compiler can vectorize them. */
+
 /*
  * WK_pack_2bits()
  * Pack some multiple of four words holding two-bit tags (in the low
@@ -7,24 +11,19 @@
  * one fourth as many.
  * NOTE: Pad the input out with zeroes to a multiple of four words!
  */
-static WK_word *WK_pack_2bits(WK_word *source_buf, WK_word *source_end,
-                              WK_word *dest_buf)
+static WK_word *WK_pack_2bits(const WK_word *restrict source_buf,
+                              const WK_word *source_end,
+                              WK_word *restrict dest_buf)
 {
-    register WK_word *src_next = source_buf;
-    WK_word *dest_next = dest_buf;
-
-    while (src_next < source_end) {
-        register WK_word temp = src_next[0];
-        temp |= (src_next[1] << 2);
-        temp |= (src_next[2] << 4);
-        temp |= (src_next[3] << 6);
-
-        dest_next[0] = temp;
-        dest_next++;
-        src_next += 4;
+    size_t n = (source_end - source_buf) / 4;
+
+    for (size_t i = 0; i < n; i++) {
+        dest_buf[i] = source_buf[4 * i] | (source_buf[4 * i + 1] << 2) |
+                      (source_buf[4 * i + 2] << 4) |
+                      (source_buf[4 * i + 3] << 6);
     }
 
-    return dest_next;
+    return dest_buf + n;
 }
 
 /*
@@ -34,23 +33,17 @@ static WK_word *WK_pack_2bits(WK_word *source_buf, WK_word *source_end,
  * note: pad out the input with zeroes to an even number of words!
  */
 
-static WK_word *WK_pack_4bits(WK_word *source_buf, WK_word *source_end,
-                              WK_word *dest_buf)
+static WK_word *WK_pack_4bits(const WK_word *restrict source_buf,
+                              const WK_word *source_end,
+                              WK_word *restrict dest_buf)
 {
-    register WK_word *src_next = source_buf;
-    WK_word *dest_next = dest_buf;
-
-    /* this loop should probably be unrolled */
-    while (src_next < source_end) {
-        register WK_word temp = src_next[0];
-        temp |= (src_next[1] << 4);
+    size_t n = (source_end - source_buf) / 2;
 
-        dest_next[0] = temp;
-        dest_next++;
-        src_next += 2;
+    for (size_t i = 0; i < n; i++) {
+        dest_buf[i] = source_buf[2 * i] | (source_buf[2 * i + 1] << 4);
     }
 
-    return dest_next;
+    return dest_buf + n;
 }
 
 /*
@@ -58,24 +51,18 @@ static WK_word *WK_pack_4bits(WK_word *source_buf, WK_word *source_end,
  * Pack a sequence of three ten bit items into one word.
  * note: pad out the input with zeroes to an even number of words!
  */
-static WK_word *WK_pack_3_tenbits(WK_word *source_buf, WK_word *source_end,
-                                  WK_word *dest_buf)
+static WK_word *WK_pack_3_tenbits(const WK_word *restrict source_buf,
+                                  const WK_word *source_end,
+                                  WK_word *restrict dest_buf)
 {
-    register WK_word *src_next = source_buf;
-    WK_word *dest_next = dest_buf;
-
-    /* this loop should probably be unrolled */
-    while (src_next < source_end) {
-        register WK_word temp = src_next[0];
-        temp |= (src_next[1] << 10);
-        temp |= (src_next[2] << 20);
-
-        dest_next[0] = temp;
-        dest_next++;
-        src_next += 3;
+    size_t n = (source_end - source_buf) / 3;
+
+    for (size_t i = 0; i < n; i++) {
+        dest_buf[i] = source_buf[3 * i] | (source_buf[3 * i + 1] << 10) |
+                      (source_buf[3 * i + 2] << 20);
     }
 
-    return dest_next;
+    return dest_buf + n;
 }
 
 unsigned int WKdm_compress(WK_word *src_buf, WK_word *dest_buf, int byte_budget)
@@ -124,6 +111,14 @@ unsigned int WKdm_compress(WK_word *src_buf, WK_word *dest_buf, int byte_budget)
         return -1;
     }
 
+    /*
+     * Zero pages are by far the most common input and compress to
+     * nothing; buffer_is_zero() picks the best SIMD variant at runtime.
+     */
+    if (buffer_is_zero(src_buf, TARGET_PAGE_SIZE)) {
+        return SV_RETURN;
+    }
+
     PRELOAD_DICTIONARY;
 
     next_full_patt = dest_buf + TAGS_AREA_OFFSET + (num_input_words / 16);
@@ -1,3 +1,4 @@
+#include "qemu/osdep.h"
 #include "WKdm_internal.h"
 
 const char hashLookupTable[] = HASH_LOOKUP_TABLE_CONTENTS;
@@ -7,29 +8,21 @@ const char hashLookupTable[] = HASH_LOOKUP_TABLE_CONTENTS;
  *  two bit values as bytes (with the low two bits of each byte holding
  *  the actual value.
  */
-static WK_word *WK_unpack_2bits(WK_word *input_buf, WK_word *input_end,
-                                WK_word *output_buf)
+static WK_word *WK_unpack_2bits(const WK_word *restrict input_buf,
+                                const WK_word *input_end,
+                                WK_word *restrict output_buf)
 {
-    register WK_word *input_next = input_buf;
-    register WK_word *output_next = output_buf;
-    register WK_word packing_mask = TWO_BITS_PACKING_MASK;
-
-    /* loop to repeatedly grab one input word and unpack it into
-     * 4 output words.  This loop could be unrolled a little---it's
-     * designed to be easy to do that.
-     */
-    while (input_next < input_end) {
-        register WK_word temp = input_next[0];
-        output_next[0] = temp & packing_mask;
-        output_next[1] = (temp >> 2) & packing_mask;
-        output_next[2] = (temp >> 4) & packing_mask;
-        output_next[3] = (temp >> 6) & packing_mask;
-
-        output_next += 4;
-        input_next++;
+    size_t n = input_end > input_buf ? input_end - input_buf : 0;
+
+    for (size_t i = 0; i < n; i++) {
+        WK_word temp = input_buf[i];
+        output_buf[4 * i] = temp & TWO_BITS_PACKING_MASK;
+        output_buf[4 * i + 1] = (temp >> 2) & TWO_BITS_PACKING_MASK;
+        output_buf[4 * i + 2] = (temp >> 4) & TWO_BITS_PACKING_MASK;
+        output_buf[4 * i + 3] = (temp >> 6) & TWO_BITS_PACKING_MASK;
     }
 
-    return output_next;
+    return output_buf + 4 * n;
 }
 
 /* unpack four bits consumes any number of words (between input_buf
@@ -38,56 +31,38 @@ static WK_word *WK_unpack_2bits(WK_word *input_buf, WK_word *input_end,
  * (The four-bit values occupy the low halves of the bytes in the
  * result).
  */
-static WK_word *WK_unpack_4bits(WK_word *input_buf, WK_word *input_end,
-                                WK_word *output_buf)
+static WK_word *WK_unpack_4bits(const WK_word *restrict input_buf,
+                                const WK_word *input_end,
+                                WK_word *restrict output_buf)
 {
-    register WK_word *input_next = input_buf;
-    register WK_word *output_next = output_buf;
-    register WK_word packing_mask = FOUR_BITS_PACKING_MASK;
-
-
-    /* loop to repeatedly grab one input word and unpack it into
-     * 4 output words.  This loop should probably be unrolled
-     * a little---it's designed to be easy to do that.
-     */
-    while (input_next < input_end) {
-        register WK_word temp = input_next[0];
-        output_next[0] = temp & packing_mask;
-        output_next[1] = (temp >> 4) & packing_mask;
+    size_t n = input_end > input_buf ? input_end - input_buf : 0;
 
-        output_next += 2;
-        input_next++;
+    for (size_t i = 0; i < n; i++) {
+        WK_word temp = input_buf[i];
+        output_buf[2 * i] = temp & FOUR_BITS_PACKING_MASK;
+        output_buf[2 * i + 1] = (temp >> 4) & FOUR_BITS_PACKING_MASK;
     }
 
-    return output_next;
+    return output_buf + 2 * n;
 }
 
 /* unpack_3_tenbits unpacks three 10-bit items from (the low 30 bits of)
  * a 32-bit word
  */
-static WK_word *WK_unpack_3_tenbits(WK_word *input_buf, WK_word *input_end,
-                                    WK_word *output_buf)
+static WK_word *WK_unpack_3_tenbits(const WK_word *restrict input_buf,
+                                    const WK_word *input_end,
+                                    WK_word *restrict output_buf)
 {
-    register WK_word *input_next = input_buf;
-    register WK_word *output_next = output_buf;
-    register WK_word packing_mask = LOW_BITS_MASK;
-
-    /* loop to fetch words of input, splitting each into three
-     * words of output with 10 meaningful low bits.  This loop
-     * probably ought to be unrolled and maybe coiled
-     */
-    while (input_next < input_end) {
-        register WK_word temp = input_next[0];
-
-        output_next[0] = temp & packing_mask;
-        output_next[1] = (temp >> 10) & packing_mask;
-        output_next[2] = temp >> 20;
+    size_t n = input_end > input_buf ? input_end - input_buf : 0;
 
-        input_next++;
-        output_next += 3;
+    for (size_t i = 0; i < n; i++) {
+        WK_word temp = input_buf[i];
+        output_buf[3 * i] = temp & LOW_BITS_MASK;
+        output_buf[3 * i + 1] = (temp >> 10) & LOW_BITS_MASK;
+        output_buf[3 * i + 2] = temp >> 20;
     }
 
-    return output_next;
+    return output_buf + 3 * n;
 }
 
 /*********************************************************************
@@ -918,6 +918,7 @@ void HELPER(gexit)(CPUARMState *env)
     int cur_el = arm_current_el(env);
     uint32_t spsr = env->gxf.spsr_gl[cur_el];
 
+    arm_gxf_hflags_save(env);
     aarch64_save_sp(env, cur_el);
 
     if (arm_generate_debug_exceptions(env)) {
@@ -934,7 +935,8 @@ void HELPER(gexit)(CPUARMState *env)
     env->gxf.gxf_status_el[cur_el] &= ~1;
     aarch64_restore_sp(env, cur_el);
     env->pc = env->gxf.elr_gl[cur_el];
-    helper_rebuild_hflags_a64(env, cur_el);
+    env->gxf.gl_transitions++;
+    arm_gxf_hflags_switch(env, cur_el);
     qemu_log_mask(CPU_LOG_INT, "Guarded execution exit from AArch64 GL%d to "
                       "AArch64 EL%d PC 0x%" PRIx64 "\n",
                       cur_el, cur_el, env->pc);
@@ -411,6 +411,53 @@ static CPUARMTBFlags rebuild_hflags_a64(CPUARMState *env, int el, int fp_el,
     return rebuild_hflags_common(env, fp_el, mmu_idx, flags);
 }
 
+/*
+ * PSTATE bits that rebuild_hflags_a64() depends on, and that change
+ * across GENTER/GEXIT without a full rebuild. PSTATE.D is kept in
+ * env->daif and feeds SS_ACTIVE through arm_singlestep_active().
+ * PSTATE.SS itself is not part of hflags.
+ */
+#define GXF_HFLAGS_PSTATE_MASK \
+    (PSTATE_PAN | PSTATE_UAO | PSTATE_IL | PSTATE_TCO)
+
+static uint32_t gxf_hflags_key(CPUARMState *env, int el)
+{
+    return (env->pstate & GXF_HFLAGS_PSTATE_MASK) | (env->daif & PSTATE_D) |
+           el;
+}
+
+static void gxf_hflags_invalidate(CPUARMState *env)
+{
+    env->gxf.hflags_valid[0] = false;
+    env->gxf.hflags_valid[1] = false;
+}
+
+void arm_gxf_hflags_save(CPUARMState *env)
+{
+    int guarded = arm_is_guarded(env);
+
+    env->gxf.hflags[guarded] = env->hflags;
+    env->gxf.hflags_key[guarded] = gxf_hflags_key(env, arm_current_el(env));
+    env->gxf.hflags_valid[guarded] = true;
+}
+
+void arm_gxf_hflags_switch(CPUARMState *env, int el)
+{
+    int guarded = arm_is_guarded(env);
+    uint32_t key = gxf_hflags_key(env, el);
+
+    if (env->gxf.hflags_valid[guarded] && env->gxf.hflags_key[guarded] == key) {
+        env->hflags = env->gxf.hflags[guarded];
+        return;
+    }
+
+    env->hflags = rebuild_hflags_a64(env, el, fp_exception_el(env, el),
+                                     arm_mmu_idx_el(env, el));
+    env->gxf.hflags[guarded] = env->hflags;
+    env->gxf.hflags_key[guarded] = key;
+    env->gxf.hflags_valid[guarded] = true;
+}
+
 static CPUARMTBFlags rebuild_hflags_internal(CPUARMState *env)
 {
     int el = arm_current_el(env);
@@ -428,6 +475,7 @@ static CPUARMTBFlags rebuild_hflags_internal(CPUARMState *env)
 
 void arm_rebuild_hflags(CPUARMState *env)
 {
+    gxf_hflags_invalidate(env);
     env->hflags = rebuild_hflags_internal(env);
 }
 
@@ -441,6 +489,7 @@ void HELPER(rebuild_hflags_m32_newel)(CPUARMState *env)
     int fp_el = fp_exception_el(env, el);
     ARMMMUIdx mmu_idx = arm_mmu_idx_el(env, el);
 
+    gxf_hflags_invalidate(env);
     env->hflags = rebuild_hflags_m32(env, fp_el, mmu_idx);
 }
 
@@ -449,6 +498,7 @@ void HELPER(rebuild_hflags_m32)(CPUARMState *env, int el)
     int fp_el = fp_exception_el(env, el);
     ARMMMUIdx mmu_idx = arm_mmu_idx_el(env, el);
 
+    gxf_hflags_invalidate(env);
     env->hflags = rebuild_hflags_m32(env, fp_el, mmu_idx);
 }
 
@@ -461,6 +511,7 @@ void HELPER(rebuild_hflags_a32_newel)(CPUARMState *env)
     int el = arm_current_el(env);
     int fp_el = fp_exception_el(env, el);
     ARMMMUIdx mmu_idx = arm_mmu_idx_el(env, el);
+    gxf_hflags_invalidate(env);
     env->hflags = rebuild_hflags_a32(env, fp_el, mmu_idx);
 }
 
@@ -469,6 +520,7 @@ void HELPER(rebuild_hflags_a32)(CPUARMState *env, int el)
     int fp_el = fp_exception_el(env, el);
     ARMMMUIdx mmu_idx = arm_mmu_idx_el(env, el);
 
+    gxf_hflags_invalidate(env);
     env->hflags = rebuild_hflags_a32(env, fp_el, mmu_idx);
 }
 
@@ -477,6 +529,7 @@ void HELPER(rebuild_hflags_a64)(CPUARMState *env, int el)
     int fp_el = fp_exception_el(env, el);
     ARMMMUIdx mmu_idx = arm_mmu_idx_el(env, el);
 
+    gxf_hflags_invalidate(env);
     env->hflags = rebuild_hflags_a64(env, el, fp_el, mmu_idx);
 }
 
@@ -411,6 +411,34 @@ void HELPER(wfi)(CPUARMState *env, uint32_t insn_len)
 
 void HELPER(wfe)(CPUARMState *env)
 {
+#ifndef CONFIG_USER_ONLY
+    ARMCPU *cpu = env_archcpu(env);
+    CPUState *cs = env_cpu(env);
+
+    /*
+     * CPUs with ARM_FEATURE_WFE_HALT (Apple IOP cores, which only ever
+     * wait for their mailbox or timer interrupt) halt like WFI until
+     * an interrupt arrives or wfe_timer expires. The configurable
+     * traps are not implemented for this case.
+     */
+    if (arm_feature(env, ARM_FEATURE_WFE_HALT) && cpu->wfe_timer) {
+        if (env->event_register) {
+            env->event_register = 0;
+            return;
+        }
+        if (cpu_has_work(cs) ||
+            (cpu->wfe_event_hook &&
+             cpu->wfe_event_hook(cpu, cpu->wfe_event_opaque))) {
+            return;
+        }
+        timer_mod(cpu->wfe_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                      cpu->wfe_timeout_ns);
+        qatomic_inc(&cpu->wfe_halts);
+        cs->exception_index = EXCP_HLT;
+        cs->halted = 1;
+        cpu_loop_exit(cs);
+    }
+#endif
     /* This is a hint instruction that is semantically different
      * from YIELD even though we currently implement it identically.
      * Don't actually halt the CPU, just yield back to top
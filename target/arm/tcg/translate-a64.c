@@ -1693,13 +1693,33 @@ static bool trans_WFE(DisasContext *s, arg_WFI *a)
      * WFE helpers as it won't affect the scheduling of other vCPUs.
      * If we wanted to more completely model WFE/SEV so we don't busy
      * spin unnecessarily we would need to do something more involved.
+     * CPUs with ARM_FEATURE_WFE_HALT always use the helper, which halts.
      */
-    if (!(tb_cflags(s->base.tb) & CF_PARALLEL)) {
+    if (!(tb_cflags(s->base.tb) & CF_PARALLEL) ||
+        arm_dc_feature(s, ARM_FEATURE_WFE_HALT)) {
         s->base.is_jmp = DISAS_WFE;
     }
     return true;
 }
 
+/*
+ * SEV and SEVL only matter to CPUs whose WFE can block. There is a single
+ * such CPU per machine, so SEV only has to set the local event register.
+ */
+static bool trans_SEV(DisasContext *s, arg_SEV *a)
+{
+    if (arm_dc_feature(s, ARM_FEATURE_WFE_HALT)) {
+        tcg_gen_st_i32(tcg_constant_i32(1), tcg_env,
+                       offsetof(CPUARMState, event_register));
+    }
+    return true;
+}
+
+static bool trans_SEVL(DisasContext *s, arg_SEVL *a)
+{
+    return trans_SEV(s, a);
+}
+
 static bool trans_XPACLRI(DisasContext *s, arg_XPACLRI *a)
 {
     if (s->pauth_active) {
@@ -6088,17 +6088,37 @@ static bool trans_WFE(DisasContext *s, arg_WFE *a)
     /*
      * When running single-threaded TCG code, use the helper to ensure that
      * the next round-robin scheduled vCPU gets a crack.  In MTTCG mode we
-     * just skip this instruction.  Currently the SEV/SEVL instructions,
-     * which are *one* of many ways to wake the CPU from WFE, are not
-     * implemented so we can't sleep like WFI does.
+     * just skip this instruction.  The event register that SEV/SEVL set,
+     * which is *one* of many ways to wake the CPU from WFE, is only
+     * modelled on CPUs with ARM_FEATURE_WFE_HALT, so only those sleep,
+     * and the helper bounds the sleep itself.
      */
-    if (!(tb_cflags(s->base.tb) & CF_PARALLEL)) {
+    if (!(tb_cflags(s->base.tb) & CF_PARALLEL) ||
+        arm_dc_feature(s, ARM_FEATURE_WFE_HALT)) {
         gen_update_pc(s, curr_insn_len(s));
         s->base.is_jmp = DISAS_WFE;
     }
     return true;
 }
 
+/*
+ * SEV and SEVL only matter to CPUs whose WFE can block. There is a single
+ * such CPU per machine, so SEV only has to set the local event register.
+ */
+static bool trans_SEV(DisasContext *s, arg_SEV *a)
+{
+    if (arm_dc_feature(s, ARM_FEATURE_WFE_HALT)) {
+        tcg_gen_st_i32(tcg_constant_i32(1), tcg_env,
+                       offsetof(CPUARMState, event_register));
+    }
+    return true;
+}
+
+static bool trans_SEVL(DisasContext *s, arg_SEVL *a)
+{
+    return trans_SEV(s, a);
+}
+
 static bool trans_WFI(DisasContext *s, arg_WFI *a)
 {
     /* For WFI, halt the vCPU until an IRQ. */